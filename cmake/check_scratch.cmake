@@ -0,0 +1,37 @@
+# Post-build check for VIDEO_SCRATCH builds: the DVI scanline code and its
+# tables must have been linked into the scratch X/Y banks, with nothing of it
+# left in flash.  Only symbols video.c defines are checked; the SDK calls it
+# makes (the pico_util queue operations) still run from flash.
+#
+# Usage: cmake -DNM=<nm> -DELF=<firmware.elf> -P check_scratch.cmake
+
+execute_process(COMMAND ${NM} ${ELF}
+  OUTPUT_VARIABLE SYMBOLS
+  RESULT_VARIABLE NM_RESULT)
+
+if(NOT NM_RESULT EQUAL 0)
+  message(FATAL_ERROR "Failed to read symbols from ${ELF}")
+endif()
+
+foreach(SYM scanline_callback mac_tmds_lut blank_border)
+  if(NOT SYMBOLS MATCHES "([0-9a-fA-F]+) [tTdDbB] ${SYM}\n")
+    message(FATAL_ERROR "${SYM} not found in ${ELF}")
+  endif()
+
+  # SCRATCH_X is 0x20040000-0x20040fff, SCRATCH_Y 0x20041000-0x20041fff
+  set(ADDR ${CMAKE_MATCH_1})
+  if(NOT ADDR MATCHES "^2004[01]")
+    message(FATAL_ERROR "${SYM} is at 0x${ADDR}, outside scratch SRAM")
+  endif()
+
+  message(STATUS "${SYM} at 0x${ADDR}")
+endforeach()
+
+# The scanline helpers must have been inlined into scanline_callback: a
+# leftover copy (gcc may suffix it, e.g. .constprop.0) would run from flash
+foreach(SYM prepare_scanline fill_active_line encode_line_lut encode_line_table
+    fill_overlay_line line_cache_slot line_cache_match)
+  if(SYMBOLS MATCHES "([0-9a-fA-F]+) [tT] ${SYM}(\\.[^\n]*)?\n")
+    message(FATAL_ERROR "${SYM} was not inlined, a copy is at 0x${CMAKE_MATCH_1}")
+  endif()
+endforeach()
@@ -0,0 +1,42 @@
+/*
+ * pico-umac copy-on-write overlay disc
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DISC_OVERLAY_H
+#define DISC_OVERLAY_H
+
+#include <inttypes.h>
+#include "umac.h"
+#include "ff.h"
+#include "tf_card.h"
+
+/* Make the read-only disc writable, keeping changed sectors in the file
+ * path on the (mounted) SD card, which is created if missing.  One for
+ * a different base is renamed to <path>.old first; one that can't be read
+ * is left alone.  fp is the file object to use for it.  Returns 0, or -1
+ * leaving disc untouched.
+ */
+int             disc_overlay_setup(disc_descr_t *disc, const char *path, FIL *fp,
+                                   const pico_fatfs_spi_config_t *spi);
+
+#endif
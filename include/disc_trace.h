@@ -0,0 +1,42 @@
+/*
+ * pico-umac disc I/O trace
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DISC_TRACE_H
+#define DISC_TRACE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/* Note one op_read/op_write request: byte offset and length, how long it
+ * took, and its result: 0, a FatFs FRESULT, or -1 for other failures.
+ */
+void            disc_trace_record(bool write, uint32_t offset, uint32_t len,
+                                  uint32_t latency_us, int result);
+
+/* Print the histograms and recent requests to stdout (UART) and, if path
+ * isn't NULL, write them as CSV to that file on the SD card.
+ */
+void            disc_trace_dump(const char *path);
+
+#endif
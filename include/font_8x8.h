@@ -2,6 +2,11 @@
 #define _IMG_ASSET_SECTION ".data"
 #endif
 
+#define FONT_CHAR_WIDTH 8
+#define FONT_CHAR_HEIGHT 8
+#define FONT_N_CHARS 95
+#define FONT_FIRST_ASCII 32
+
 static const char __attribute__((aligned(4), section(_IMG_ASSET_SECTION ".font_8x8"))) font_8x8[] = {
 	0x00, 0x18, 0x66, 0x2c, 0x08, 0x42, 0x38, 0x18, 0x30, 0x08, 0x36, 0x00, 0x00, 0x00, 0x00, 0x40,
 	0x3c, 0x10, 0x3c, 0x3c, 0x38, 0x7e, 0x3c, 0x7e, 0x3c, 0x3c, 0x00, 0x00, 0x20, 0x00, 0x0c, 0x1c,
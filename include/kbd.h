@@ -31,6 +31,9 @@
 #include <stdbool.h>
 
 bool            kbd_queue_empty();
+/* The [7:0] value kbd_queue_pop() gives for a keymap.h MKC_ code */
+#define KBD_MAC_KEY(mkc)        (((mkc) << 1) | 1)
+
 /* If empty, return 0, else return a mac keycode in [7:0] and [15] set if a press (else release) */
 uint16_t        kbd_queue_pop();
 
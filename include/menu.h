@@ -5,18 +5,16 @@
 #include <stdbool.h>
 #include "ff.h"
 
-#define FONT_CHAR_WIDTH 8
-#define FONT_CHAR_HEIGHT 8
-#define FONT_N_CHARS 95
-#define FONT_FIRST_ASCII 32
 #define VIDEO_FB_HRES           512
 #define VIDEO_FB_VRES           342
 #define STRIDE (VIDEO_FB_HRES / 8)
+#define MENU_FB_BYTES (STRIDE * VIDEO_FB_VRES)
 #define COLS (VIDEO_FB_HRES / 8)
-#define ROWS (VIDEO_FB_VRES / 8)
+#define ROWS (VIDEO_FB_VRES / 9) //8px glyphs plus a blank line
 #define FIRST_ITEM_ROW 5
 #define ITEM_ROWS (ROWS - (FIRST_ITEM_ROW + 1))
-void init_menu(uint8_t* fb, FATFS* filesystem);
+//index_arena is scratch RAM for the screen text and folder index
+void init_menu(uint8_t* fb, FATFS* filesystem, uint8_t* index_arena, uint32_t index_size);
 bool process_menu(FIL* file);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,69 @@
+/*
+ * pico-umac SD card disc image access
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SD_DISC_H
+#define SD_DISC_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "ff.h"
+#include "tf_card.h"
+
+#define SD_DISC_SECTOR_SIZE     512
+
+/* Use an opened image file for all following reads/writes.  spi is the
+ * configuration the card was mounted with.
+ */
+void            sd_disc_open(FIL *fp, const pico_fatfs_spi_config_t *spi);
+
+/* Pick the SD SPI clock: the rate cached on the card if test reads still
+ * pass at it (writing nothing), else the fastest that passes CRC-checked
+ * test reads and writes, which is then cached.  scratch is RAM free for
+ * the duration.
+ */
+void            sd_disc_tune_clock(const pico_fatfs_spi_config_t *spi, uint8_t *scratch,
+                                   unsigned int scratch_len);
+
+/* Same contract as umac's disc op_read/op_write: 0 on success, else -1 */
+int             sd_disc_read(uint8_t *data, unsigned int offset, unsigned int len);
+int             sd_disc_write(uint8_t *data, unsigned int offset, unsigned int len);
+/* Why the last sd_disc_read()/sd_disc_write() failed, as a FatFs result
+ * (disk driver and DMA errors as FatFs reports them); FR_OK if it didn't
+ * fail in the card or filesystem
+ */
+FRESULT         sd_disc_last_result();
+
+/* Write back dirty cached sectors and sync the file */
+int             sd_disc_flush();
+/* True if there are writes sd_disc_flush() hasn't got onto the card yet */
+bool            sd_disc_unsaved();
+/* Housekeeping from the emulator loop: flushes when the disc goes idle,
+ * or once data has been unsaved too long, at most once per DISC_FLUSH_MS
+ * while flushes are failing
+ */
+void            sd_disc_poll();
+
+void            sd_disc_print_stats();
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * pico-umac's own files on the SD card
+ *
+ * They all live in one folder, which the image selector doesn't list.
+ * main.c creates it after mounting the card.
+ */
+
+#ifndef SD_FILES_H
+#define SD_FILES_H
+
+#define SD_STATE_DIR            "/umac"
+
+#define MENU_LAST_FILE          SD_STATE_DIR "/last.cfg"        /* Image last picked */
+#define MENU_CATALOG_DIR        SD_STATE_DIR "/idx"             /* Folder listings */
+#define SD_TUNE_FILE            SD_STATE_DIR "/sd.cfg"          /* SPI clock that works */
+#define SD_TUNE_WRITE_FILE      SD_STATE_DIR "/sd.tmp"          /* Only while tuning */
+#define DISC_TRACE_FILE         SD_STATE_DIR "/trace.csv"
+#define DISC_OVERLAY_FILE       SD_STATE_DIR "/disc0.cow"       /* Changes to the flash disc */
+
+#endif
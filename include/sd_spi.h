@@ -0,0 +1,67 @@
+/*
+ * pico-umac SD card multi-block SPI/DMA transfers
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SD_SPI_H
+#define SD_SPI_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "hardware/spi.h"
+
+/* Take over an SD card that pico_fatfs has already initialised.  The SPI
+ * pins, clock and chip select are left as FatFs set them up.
+ * block_addressed is true for SDHC/SDXC (CT_BLOCK) cards.
+ */
+bool            sd_spi_init(spi_inst_t *spi, uint cs_pin, bool block_addressed);
+
+/* Read/write count 512-byte sectors from card sector lba: 0 on success */
+int             sd_spi_read(uint32_t lba, uint8_t *buf, unsigned int count);
+int             sd_spi_write(uint32_t lba, const uint8_t *buf, unsigned int count);
+
+/* Check the CRC16 of every block read (off by default, it costs CPU) */
+void            sd_spi_set_crc_check(bool enable);
+
+/* Find the fastest SPI clock from max_hz down to min_hz at which reads of
+ * card sectors [lba, lba + sectors) pass CRC checks and match a read made
+ * at safe_hz.  buf must hold 2 * sectors sectors.  Leaves the SPI at the
+ * chosen rate and returns it, or returns 0 with the SPI at safe_hz.
+ */
+uint32_t        sd_spi_tune(uint32_t lba, unsigned int sectors, uint32_t max_hz,
+                            uint32_t min_hz, uint32_t safe_hz, uint8_t *buf);
+
+/* Like sd_spi_tune(), but only try the current SPI clock */
+bool            sd_spi_verify(uint32_t lba, unsigned int sectors, uint32_t safe_hz, uint8_t *buf);
+
+/* Check writes at the current SPI clock: write patterns to card sectors
+ * [lba, lba + sectors), which are lost, and read them back CRC-checked
+ * at safe_hz.  buf must hold 2 * sectors sectors.
+ */
+bool            sd_spi_verify_write(uint32_t lba, unsigned int sectors, uint32_t safe_hz, uint8_t *buf);
+
+/* Print MB/s for sequential and random 512B/4KB transfers within
+ * [lba, lba + sectors).  Writes put back the data just read.
+ */
+void            sd_spi_benchmark(uint32_t lba, uint32_t sectors);
+
+#endif
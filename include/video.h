@@ -5,5 +5,12 @@
 
 void video_init();
 void set_framebuffer(uint8_t *framebuffer);
+void video_print_stats();
+/* Status text shown above the Mac picture (VIDEO_OVERLAY builds) */
+void video_set_overlay(const char *text);
+/* Snapshot the framebuffer for scan-out (VIDEO_LATCH builds) */
+void video_latch_framebuffer();
+/* Number of frames whose vertical blank has started, and when the last did */
+uint32_t video_get_vblank(uint32_t *time_us);
 
 #endif
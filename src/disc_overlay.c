@@ -0,0 +1,322 @@
+/* Copy-on-write overlay disc
+ *
+ * Reads come from the read-only base disc (the in-flash image) unless a
+ * sector has been written, in which case it comes from a delta file on
+ * the SD card.  The delta file holds a header sector, a bitmap of which
+ * sectors it has, then every sector of the disc at its own position.
+ * It's allocated at full size up front (an allocation, not a copy), so
+ * it's usually contiguous and goes through sd_disc's cache and raw path.
+ *
+ * A sector's data is flushed to the card before its bitmap bit, so a
+ * power cut can lose recent writes but never expose unwritten space.
+ * An existing delta file is never truncated: one for another base is
+ * renamed aside, and one that can't be read keeps the disc read-only.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "disc_overlay.h"
+#include "sd_disc.h"
+
+/* Largest base disc supported, which sizes the bitmap */
+#ifndef DISC_OVERLAY_MAX_KB
+#define DISC_OVERLAY_MAX_KB     4096
+#endif
+
+#define SECTOR                  SD_DISC_SECTOR_SIZE
+#define MAX_SECTORS             (DISC_OVERLAY_MAX_KB * 1024 / SECTOR)
+/* Whole sectors, as it's stored */
+#define BITMAP_BYTES            (((MAX_SECTORS + 8 * SECTOR - 1) / (8 * SECTOR)) * SECTOR)
+
+#define OVERLAY_MAGIC           0x57434d55      /* "UMCW" */
+#define OVERLAY_VERSION         1
+
+struct overlay_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t sector_size;
+        uint32_t base_size;
+        uint32_t base_hash;     /* Deltas only make sense on the same base */
+};
+
+static disc_descr_t base_disc;
+static uint32_t base_hash;
+static uint32_t n_sectors;
+static uint32_t data_offset;    /* Of sector 0 in the delta file */
+static uint8_t bitmap[BITMAP_BYTES];
+static uint8_t merge_buf[SECTOR] __attribute__((aligned(4)));
+
+static inline bool present(uint32_t sector)
+{
+        return bitmap[sector / 8] & (1 << (sector % 8));
+}
+
+static int      base_read(uint8_t *data, unsigned int offset, unsigned int len)
+{
+        if (base_disc.base) {
+                memcpy(data, base_disc.base + offset, len);
+                return 0;
+        }
+        return base_disc.op_read(base_disc.op_ctx, data, offset, len);
+}
+
+/* FNV-1a over the stored base; cheap next to a boot, and catches a reflash */
+static uint32_t hash_base()
+{
+        uint32_t h = 2166136261u;
+
+        for (uint32_t pos = 0; pos < base_disc.size; pos += SECTOR) {
+                if (base_read(merge_buf, pos, SECTOR) != 0)
+                        return 0;
+                for (int i = 0; i < SECTOR; i++)
+                        h = (h ^ merge_buf[i]) * 16777619u;
+        }
+        return h;
+}
+
+static int      overlay_read(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
+{
+        if (offset > base_disc.size || len > base_disc.size - offset)
+                return -1;
+
+        /* Runs of sectors from the same place, which needn't be aligned */
+        while (len > 0) {
+                uint32_t sector = offset / SECTOR;
+                bool delta = present(sector);
+                unsigned int n = SECTOR - offset % SECTOR;
+
+                while (n < len && present(++sector) == delta)
+                        n += SECTOR;
+                if (n > len)
+                        n = len;
+
+                int ret = delta ? sd_disc_read(data, data_offset + offset, n) :
+                        base_read(data, offset, n);
+                if (ret != 0)
+                        return -1;
+
+                data += n;
+                offset += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static int      overlay_write(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
+{
+        uint32_t first_new = UINT32_MAX;
+        uint32_t last_new = 0;
+
+        if (offset > base_disc.size || len > base_disc.size - offset)
+                return -1;
+
+        while (len > 0) {
+                uint32_t sector = offset / SECTOR;
+                unsigned int start = offset % SECTOR;
+                unsigned int n = SECTOR - start;
+
+                if (n > len)
+                        n = len;
+
+                if (present(sector) || n == SECTOR) {
+                        if (sd_disc_write(data, data_offset + offset, n) != 0)
+                                return -1;
+                } else {
+                        /* First write to part of a sector: copy the rest up */
+                        if (base_read(merge_buf, sector * SECTOR, SECTOR) != 0)
+                                return -1;
+                        memcpy(merge_buf + start, data, n);
+                        if (sd_disc_write(merge_buf, data_offset + sector * SECTOR, SECTOR) != 0)
+                                return -1;
+                }
+
+                if (!present(sector)) {
+                        if (first_new == UINT32_MAX)
+                                first_new = sector;
+                        last_new = sector;
+                }
+
+                data += n;
+                offset += n;
+                len -= n;
+        }
+
+        if (first_new == UINT32_MAX)
+                return 0;
+
+        /* Data before bitmap, then the bitmap bytes that changed */
+        if (sd_disc_flush() != 0)
+                return -1;
+        for (uint32_t s = first_new; s <= last_new; s++)
+                bitmap[s / 8] |= 1 << (s % 8);
+        return sd_disc_write(&bitmap[first_new / 8], SECTOR + first_new / 8,
+                             last_new / 8 - first_new / 8 + 1);
+}
+
+/* Start a fresh delta file: header, empty bitmap, room for every sector */
+static int      overlay_create(FIL *fp, const char *path)
+{
+        struct overlay_header hdr = {
+                .magic = OVERLAY_MAGIC,
+                .version = OVERLAY_VERSION,
+                .sector_size = SECTOR,
+                .base_size = base_disc.size,
+                .base_hash = base_hash,
+        };
+        FSIZE_t total = data_offset + n_sectors * SECTOR;
+        unsigned int did_write;
+
+        if (f_open(fp, path, FA_CREATE_ALWAYS | FA_READ | FA_WRITE) != FR_OK)
+                return -1;
+
+#if FF_USE_EXPAND
+        /* Contiguous if the card has room, so sd_disc can use raw access */
+        if (f_expand(fp, total, 1) != FR_OK)
+#elif DISC_OVERLAY
+#warning "FF_USE_EXPAND is 0 in ffconf.h: overlay files may be fragmented and miss raw SD access"
+#endif
+        {
+                printf("disc_overlay: no contiguous space for %s, it may be fragmented\n", path);
+                if (f_lseek(fp, total) != FR_OK || f_tell(fp) != total)
+                        goto fail;
+        }
+
+        memset(bitmap, 0, sizeof(bitmap));
+        memset(merge_buf, 0, SECTOR);
+        memcpy(merge_buf, &hdr, sizeof(hdr));
+        if (f_lseek(fp, 0) != FR_OK ||
+            f_write(fp, merge_buf, SECTOR, &did_write) != FR_OK || did_write != SECTOR ||
+            f_write(fp, bitmap, data_offset - SECTOR, &did_write) != FR_OK ||
+            did_write != data_offset - SECTOR ||
+            f_sync(fp) != FR_OK)
+                goto fail;
+
+        printf("disc_overlay: created %s, %lu bytes\n", path, (uint32_t)total);
+        return 0;
+
+fail:
+        f_close(fp);
+        return -1;
+}
+
+/* What overlay_open() found, other than a usable delta file (0) */
+#define OVERLAY_MISSING         1
+#define OVERLAY_STALE           2       /* For another base image */
+
+static int      overlay_open(FIL *fp, const char *path)
+{
+        struct overlay_header hdr;
+        unsigned int did_read;
+        FRESULT fr = f_open(fp, path, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+
+        if (fr == FR_NO_FILE)
+                return OVERLAY_MISSING;
+        if (fr != FR_OK) {
+                printf("disc_overlay: can't open %s (%d)\n", path, fr);
+                return -1;
+        }
+
+        if (f_read(fp, &hdr, sizeof(hdr), &did_read) != FR_OK || did_read != sizeof(hdr) ||
+            hdr.magic != OVERLAY_MAGIC || hdr.version != OVERLAY_VERSION ||
+            hdr.sector_size != SECTOR) {
+                printf("disc_overlay: %s is unreadable or not an overlay, leaving it alone\n", path);
+                goto fail;
+        }
+
+        if (hdr.base_size != base_disc.size || hdr.base_hash != base_hash) {
+                f_close(fp);
+                return OVERLAY_STALE;
+        }
+
+        if (f_size(fp) < data_offset + n_sectors * SECTOR ||
+            f_lseek(fp, SECTOR) != FR_OK ||
+            f_read(fp, bitmap, data_offset - SECTOR, &did_read) != FR_OK ||
+            did_read != data_offset - SECTOR) {
+                printf("disc_overlay: %s is truncated or unreadable, leaving it alone\n", path);
+                goto fail;
+        }
+
+        return 0;
+
+fail:
+        f_close(fp);
+        return -1;
+}
+
+/* Keep a delta file for another base as <path>.old, replacing an older one */
+static int      overlay_set_aside(const char *path)
+{
+        char old[64];
+
+        if (snprintf(old, sizeof(old), "%s.old", path) >= (int)sizeof(old))
+                return -1;
+        f_unlink(old);
+        if (f_rename(path, old) != FR_OK)
+                return -1;
+        printf("disc_overlay: %s is for a different base image, kept as %s\n", path, old);
+        return 0;
+}
+
+int             disc_overlay_setup(disc_descr_t *disc, const char *path, FIL *fp,
+                                   const pico_fatfs_spi_config_t *spi)
+{
+        if (disc->size == 0 || disc->size % SECTOR != 0 || disc->size > DISC_OVERLAY_MAX_KB * 1024) {
+                printf("disc_overlay: can't overlay a %u byte disc (DISC_OVERLAY_MAX_KB %u)\n",
+                       disc->size, DISC_OVERLAY_MAX_KB);
+                return -1;
+        }
+
+        base_disc = *disc;
+        n_sectors = disc->size / SECTOR;
+        /* Header sector, then the bitmap rounded up to whole sectors */
+        data_offset = SECTOR + ((n_sectors + 8 * SECTOR - 1) / (8 * SECTOR)) * SECTOR;
+        base_hash = hash_base();
+
+        /* Only a missing file is created; an existing one is never truncated */
+        int found = overlay_open(fp, path);
+
+        if (found == OVERLAY_STALE && overlay_set_aside(path) != 0) {
+                printf("disc_overlay: can't set %s aside\n", path);
+                return -1;
+        }
+        if (found < 0 || (found != 0 && overlay_create(fp, path) != 0)) {
+                printf("disc_overlay: not using %s, the flash disc stays read-only\n", path);
+                return -1;
+        }
+
+        sd_disc_open(fp, spi);
+
+        uint32_t changed = 0;
+        for (uint32_t s = 0; s < n_sectors; s++)
+                changed += present(s);
+        printf("disc_overlay: %s, %lu of %lu sectors changed\n", path, changed, n_sectors);
+
+        disc->base = 0; // Means use R/W ops
+        disc->read_only = 0;
+        disc->op_ctx = NULL;
+        disc->op_read = overlay_read;
+        disc->op_write = overlay_write;
+        return 0;
+}
@@ -0,0 +1,272 @@
+/* Compressed in-flash disc image
+ *
+ * The image is split into chunks that are LZ4-compressed independently
+ * (see tools/pack_disc.py for the format), so any sector can be read by
+ * decoding just its chunk.  A few decoded chunks are kept in RAM, since
+ * the Sony driver reads a chunk a sector or two at a time.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "disc_packed.h"
+
+/* Must match pack_disc.py's --chunk */
+#ifndef DISC_PACKED_CHUNK
+#define DISC_PACKED_CHUNK       4096
+#endif
+/* Decoded chunks kept in RAM */
+#ifndef DISC_PACKED_CACHE
+#define DISC_PACKED_CACHE       2
+#endif
+
+#define PACKED_MAGIC            0x4b504d55      /* "UMPK" */
+#define PACKED_VERSION          1
+#define PACKED_HEADER           16
+#define PACKED_MAX_SHIFT        14              /* pack_disc.py's largest, 16KB chunks */
+
+struct chunk_slot {
+        uint32_t chunk;
+        uint32_t last_use;
+        bool valid;
+        uint8_t data[DISC_PACKED_CHUNK] __attribute__((aligned(4)));
+};
+
+static struct chunk_slot chunk_cache[DISC_PACKED_CACHE];
+static uint32_t chunk_clock = 0;
+
+static const uint8_t *packed_table;     /* offset[n_chunks + 1] */
+static const uint8_t *packed_data;
+static uint32_t packed_size;
+static uint32_t packed_chunks;
+
+/* The image is a byte array in flash, so nothing in it is aligned */
+static inline uint32_t get32(const uint8_t *p)
+{
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Decode one LZ4 block, which must exactly fill dst */
+static int      lz4_decode(const uint8_t *src, unsigned int src_len, uint8_t *dst, unsigned int dst_len)
+{
+        const uint8_t *end = src + src_len;
+        uint8_t *op = dst;
+        uint8_t *oend = dst + dst_len;
+
+        while (src < end) {
+                unsigned int token = *src++;
+                unsigned int len = token >> 4;
+                uint8_t b;
+
+                if (len == 15) {
+                        do {
+                                if (src >= end)
+                                        return -1;
+                                b = *src++;
+                                len += b;
+                        } while (b == 255);
+                }
+                if (len > (unsigned int)(end - src) || len > (unsigned int)(oend - op))
+                        return -1;
+                memcpy(op, src, len);
+                op += len;
+                src += len;
+
+                /* The last sequence is literals only */
+                if (src >= end)
+                        break;
+
+                if (end - src < 2)
+                        return -1;
+                unsigned int offset = src[0] | (src[1] << 8);
+                src += 2;
+                if (offset == 0 || offset > (unsigned int)(op - dst))
+                        return -1;
+
+                len = token & 15;
+                if (len == 15) {
+                        do {
+                                if (src >= end)
+                                        return -1;
+                                b = *src++;
+                                len += b;
+                        } while (b == 255);
+                }
+                len += 4;
+                if (len > (unsigned int)(oend - op))
+                        return -1;
+
+                /* Byte at a time: the match may overlap what it's producing */
+                const uint8_t *match = op - offset;
+                while (len--)
+                        *op++ = *match++;
+        }
+        return op == oend ? 0 : -1;
+}
+
+static int      decode_chunk(uint32_t chunk, uint8_t *dst, unsigned int len)
+{
+        uint32_t start = get32(packed_table + chunk * 4);
+        uint32_t packed_len = get32(packed_table + (chunk + 1) * 4) - start;
+
+        if (packed_len == 0) {
+                memset(dst, 0, len);
+                return 0;
+        }
+        if (packed_len == len) {
+                memcpy(dst, packed_data + start, len);
+                return 0;
+        }
+        return lz4_decode(packed_data + start, packed_len, dst, len);
+}
+
+static struct chunk_slot *get_chunk(uint32_t chunk, unsigned int len)
+{
+        struct chunk_slot *victim = &chunk_cache[0];
+
+        for (int i = 0; i < DISC_PACKED_CACHE; i++) {
+                if (chunk_cache[i].valid && chunk_cache[i].chunk == chunk) {
+                        chunk_cache[i].last_use = ++chunk_clock;
+                        return &chunk_cache[i];
+                }
+                if (!chunk_cache[i].valid || chunk_cache[i].last_use < victim->last_use)
+                        victim = &chunk_cache[i];
+        }
+
+        victim->valid = false;
+        if (decode_chunk(chunk, victim->data, len) != 0) {
+                printf("disc_packed: chunk %lu is corrupt\n", chunk);
+                return NULL;
+        }
+        victim->chunk = chunk;
+        victim->valid = true;
+        victim->last_use = ++chunk_clock;
+        return victim;
+}
+
+static int      disc_packed_read(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
+{
+        if (offset > packed_size || len > packed_size - offset)
+                return -1;
+
+        while (len > 0) {
+                uint32_t chunk = offset / DISC_PACKED_CHUNK;
+                unsigned int start = offset % DISC_PACKED_CHUNK;
+                unsigned int chunk_len = packed_size - chunk * DISC_PACKED_CHUNK;
+                unsigned int n;
+
+                if (chunk_len > DISC_PACKED_CHUNK)
+                        chunk_len = DISC_PACKED_CHUNK;
+                n = chunk_len - start;
+                if (n > len)
+                        n = len;
+
+                if (n == chunk_len) {
+                        /* A whole chunk goes straight to the caller */
+                        if (decode_chunk(chunk, data, n) != 0)
+                                return -1;
+                } else {
+                        struct chunk_slot *slot = get_chunk(chunk, chunk_len);
+
+                        if (slot == NULL)
+                                return -1;
+                        memcpy(data, slot->data + start, n);
+                }
+
+                data += n;
+                offset += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static int      disc_packed_write(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
+{
+        return -1;
+}
+
+/* Reads trust the table, so check it all once: offsets never go back, no
+ * chunk is longer packed than unpacked, and the last ends in the blob.
+ */
+static bool     table_ok(unsigned int data_len)
+{
+        uint32_t prev = get32(packed_table);
+
+        for (uint32_t chunk = 0; chunk < packed_chunks; chunk++) {
+                uint32_t next = get32(packed_table + (chunk + 1) * 4);
+                uint32_t chunk_len = packed_size - chunk * DISC_PACKED_CHUNK;
+
+                if (chunk_len > DISC_PACKED_CHUNK)
+                        chunk_len = DISC_PACKED_CHUNK;
+                if (next < prev || next - prev > chunk_len)
+                        return false;
+                prev = next;
+        }
+        return prev <= data_len;
+}
+
+int             disc_packed_setup(disc_descr_t *disc, const uint8_t *packed, unsigned int packed_len)
+{
+        if (packed_len < PACKED_HEADER || get32(packed) != PACKED_MAGIC ||
+            packed[4] != PACKED_VERSION)
+                return -1;
+
+        /* Shifting by a corrupt header's 32 or more is undefined */
+        if (packed[5] > PACKED_MAX_SHIFT) {
+                printf("disc_packed: image has a bad chunk size (2^%u)\n", packed[5]);
+                return -1;
+        }
+        if ((1u << packed[5]) != DISC_PACKED_CHUNK) {
+                printf("disc_packed: image has %u byte chunks, built for %u\n",
+                       1u << packed[5], DISC_PACKED_CHUNK);
+                return -1;
+        }
+
+        packed_size = get32(packed + 8);
+        packed_chunks = get32(packed + 12);
+        packed_table = packed + PACKED_HEADER;
+
+        if (packed_chunks != (packed_size + DISC_PACKED_CHUNK - 1) / DISC_PACKED_CHUNK ||
+            packed_chunks >= (packed_len - PACKED_HEADER) / 4)
+                goto bad;
+        packed_data = packed_table + (packed_chunks + 1) * 4;
+        if (!table_ok(packed + packed_len - packed_data))
+                goto bad;
+
+        memset(chunk_cache, 0, sizeof(chunk_cache));
+
+        disc->base = 0; // Means use R/W ops
+        disc->read_only = 1;
+        disc->size = packed_size;
+        disc->op_ctx = NULL;
+        disc->op_read = disc_packed_read;
+        disc->op_write = disc_packed_write;
+
+        printf("disc_packed: %lu byte image from %u bytes of flash\n", packed_size, packed_len);
+        return 0;
+
+bad:
+        printf("disc_packed: bad packed image\n");
+        return -1;
+}
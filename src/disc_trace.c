@@ -0,0 +1,135 @@
+/* Disc I/O trace
+ *
+ * Every request the Sony driver makes is counted into size and latency
+ * histograms (log2 buckets, separately for reads and writes), and the
+ * most recent DISC_TRACE_ENTRIES are kept in a ring for dumping.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "pico/time.h"
+#include "ff.h"
+#include "disc_trace.h"
+
+#ifndef DISC_TRACE_ENTRIES
+#define DISC_TRACE_ENTRIES      256
+#endif
+
+#define SIZE_BUCKETS            10      /* <=512B, 1K, ... 128K, more */
+#define LATENCY_BUCKETS         16      /* <2us, <4us, ... <32ms, more */
+
+struct trace_entry {
+        uint32_t time_us;
+        uint32_t offset;
+        uint32_t len;
+        uint32_t latency_us : 24;
+        uint32_t write : 1;
+        int32_t result : 7;
+};
+
+static struct trace_entry trace[DISC_TRACE_ENTRIES];
+static uint32_t trace_count = 0;        /* Ever recorded; the ring holds the last few */
+
+static uint32_t size_hist[2][SIZE_BUCKETS];
+static uint32_t latency_hist[2][LATENCY_BUCKETS];
+
+static inline unsigned int log2_bucket(uint32_t v, unsigned int n)
+{
+        unsigned int b = v ? 32 - __builtin_clz(v) : 0;
+
+        return b < n ? b : n - 1;
+}
+
+void            disc_trace_record(bool write, uint32_t offset, uint32_t len,
+                                  uint32_t latency_us, int result)
+{
+        struct trace_entry *e = &trace[trace_count % DISC_TRACE_ENTRIES];
+
+        e->time_us = time_us_32();
+        e->offset = offset;
+        e->len = len;
+        e->latency_us = latency_us < (1 << 24) ? latency_us : (1 << 24) - 1;
+        e->write = write;
+        e->result = result;
+        trace_count++;
+
+        /* An empty request counts as the smallest size, not the largest */
+        size_hist[write][log2_bucket(len ? (len - 1) / 512 : 0, SIZE_BUCKETS)]++;
+        latency_hist[write][log2_bucket(latency_us / 2, LATENCY_BUCKETS)]++;
+}
+
+/* Goes to stdout, and to fp when that isn't NULL */
+static void     out(FIL *fp, const char *fmt, ...)
+{
+        char line[96];
+        va_list ap;
+        unsigned int did_write;
+
+        va_start(ap, fmt);
+        int len = vsnprintf(line, sizeof(line), fmt, ap);
+        va_end(ap);
+
+        if (len < 0)
+                return;
+        if (len >= (int)sizeof(line))
+                len = sizeof(line) - 1;
+        fputs(line, stdout);
+        if (fp)
+                f_write(fp, line, len, &did_write);
+}
+
+void            disc_trace_dump(const char *path)
+{
+        static FIL file;
+        FIL *fp = NULL;
+        uint32_t count = trace_count;
+        uint32_t first = count > DISC_TRACE_ENTRIES ? count - DISC_TRACE_ENTRIES : 0;
+
+        if (path && f_open(&file, path, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK)
+                fp = &file;
+
+        out(fp, "# size histogram: bucket,max_bytes,reads,writes\n");
+        for (int b = 0; b < SIZE_BUCKETS; b++)
+                out(fp, "size,%lu,%lu,%lu\n", b < SIZE_BUCKETS - 1 ? 512ul << b : 0,
+                    size_hist[0][b], size_hist[1][b]);
+
+        out(fp, "# latency histogram: bucket,below_us,reads,writes\n");
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+                out(fp, "latency,%lu,%lu,%lu\n", b < LATENCY_BUCKETS - 1 ? 2ul << b : 0,
+                    latency_hist[0][b], latency_hist[1][b]);
+
+        out(fp, "# last %lu of %lu requests: time_us,op,offset,len,latency_us,result\n",
+            count - first, count);
+        for (uint32_t i = first; i < count; i++) {
+                struct trace_entry *e = &trace[i % DISC_TRACE_ENTRIES];
+
+                out(fp, "%lu,%c,%lu,%lu,%lu,%d\n", e->time_us, e->write ? 'W' : 'R',
+                    e->offset, e->len, (uint32_t)e->latency_us, (int)e->result);
+        }
+
+        if (fp) {
+                f_close(fp);
+                printf("disc_trace: written to %s\n", path);
+        }
+}
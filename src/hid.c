@@ -197,10 +197,13 @@ static void process_kbd_report(hid_keyboard_report_t const *report)
 // Mouse
 //--------------------------------------------------------------------+
 
-/* Exported for use by other thread! */
-float cursor_x = 0;
-float cursor_y = 0;
-int cursor_button = 0;
+/* Exported for use by other thread!  Movement is a running total of raw
+ * mouse counts, only ever written here; the reader keeps track of how much
+ * it has consumed, so no locking is needed across cores.
+ */
+volatile int32_t cursor_x = 0;
+volatile int32_t cursor_y = 0;
+volatile int cursor_button = 0;
 
 #define MAX_DELTA       8
 
@@ -217,8 +220,8 @@ static void process_mouse_report(hid_mouse_report_t const * report)
         /* report->wheel can be used too... */
 
         cursor_button = !!(report->buttons & MOUSE_BUTTON_LEFT);
-        cursor_x += report->x / MOUSE_DIVIDER;
-        cursor_y += report->y / MOUSE_DIVIDER;
+        cursor_x += report->x;
+        cursor_y += report->y;
 }
 
 //--------------------------------------------------------------------+
@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include "kbd.h"
+#include "hardware/sync.h"
 
 #include "class/hid/hid.h"
 #include "keymap.h"
@@ -35,9 +36,13 @@
 #define KQ_SIZE         32
 #define KQ_MASK         (KQ_SIZE-1)
 
+/* Single producer (HID) and single consumer (emulator or menu), which may
+ * run on different cores.  Each index is only written by its own side, and
+ * barriers order the slot accesses against the index updates.
+ */
 static uint16_t kbd_queue[KQ_SIZE];
-static unsigned int kbd_queue_prod = 0;
-static unsigned int kbd_queue_cons = 0;
+static volatile unsigned int kbd_queue_prod = 0;
+static volatile unsigned int kbd_queue_cons = 0;
 
 static bool     kbd_queue_full()
 {
@@ -55,7 +60,9 @@ uint16_t        kbd_queue_pop()
 {
         if (kbd_queue_empty())
                 return 0;
+        __dmb();
         uint16_t v = kbd_queue[kbd_queue_cons];
+        __dmb();
         kbd_queue_cons = (kbd_queue_cons + 1) & KQ_MASK;
         return v;
 }
@@ -179,7 +186,7 @@ static bool     kbd_map(uint8_t hid_keycode, bool pressed, uint16_t *key_out)
                 return false;
         if (k == 255)
                 k = MKC_A; // Hack, this is zero
-        k = (k << 1) | 1; // FIXME just do this in the #defines
+        k = KBD_MAC_KEY(k); // FIXME just do this in the #defines
         *key_out = k | (pressed ? 0x8000 : 0); /* Convention w.r.t. main */
         return true;
 }
@@ -194,6 +201,7 @@ bool            kbd_queue_push(uint8_t hid_keycode, bool pressed)
                 return false;
 
         kbd_queue[kbd_queue_prod] = v;
+        __dmb();
         kbd_queue_prod = (kbd_queue_prod + 1) & KQ_MASK;
         return true;
 }
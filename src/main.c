@@ -39,6 +39,7 @@
 #include "pico/multicore.h"
 #include "hw.h"
 #include "kbd.h"
+#include "keymap.h"
 #include "menu.h"
 #include "bsp/rp2040/board.h"
 #include "tusb.h"
@@ -46,14 +47,38 @@
 #include "tf_card.h"
 #include "ff.h"
 #include "video.h"
+#include "sd_disc.h"
+#include "disc_packed.h"
+#include "disc_overlay.h"
+#include "disc_trace.h"
+#include "sd_files.h"
+#include "m68k.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Imports and data
 
 extern void     hid_app_task(void);
-extern float cursor_x;
-extern float cursor_y;
-extern int cursor_button;
+extern volatile int32_t cursor_x;
+extern volatile int32_t cursor_y;
+extern volatile int cursor_button;
+
+/* With USB_ON_CORE0, TinyUSB host and HID processing run on core0 between
+ * DVI interrupts and core1 is left to the emulator.  Input crosses over
+ * through the lock-free keyboard queue and mouse counters.
+ */
+#ifndef USB_ON_CORE0
+#define USB_ON_CORE0    0
+#endif
+
+/* Emulator throughput counters, reported every STATS_INTERVAL_MS from
+ * core0's idle loop (and drawn above the picture with VIDEO_OVERLAY).
+ */
+#ifndef EMU_STATS
+#define EMU_STATS       0
+#endif
+#ifndef STATS_INTERVAL_MS
+#define STATS_INTERVAL_MS       5000
+#endif
 
 static pico_fatfs_spi_config_t picofat_config =
 {
@@ -69,6 +94,18 @@ static pico_fatfs_spi_config_t picofat_config =
 
 static FATFS fs;
 
+/* umac-disc.h holds an image packed by tools/pack_disc.py, not a raw one */
+#ifndef DISC_PACKED
+#define DISC_PACKED     0
+#endif
+
+/* Choosing the flash image in the menu makes it writable, with changes
+ * kept on the SD card in DISC_OVERLAY_FILE.
+ */
+#ifndef DISC_OVERLAY
+#define DISC_OVERLAY    0
+#endif
+
 // Mac binary data:  disc and ROM images
 static const uint8_t umac_disc[] = {
 #include "umac-disc.h"
@@ -77,7 +114,8 @@ static const uint8_t umac_rom[] = {
 #include "umac-rom.h"
 };
 
-static uint8_t umac_ram[RAM_SIZE];
+/* Word aligned, the video path reads the framebuffer a word at a time */
+static uint8_t __attribute__((aligned(4))) umac_ram[RAM_SIZE];
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -90,66 +128,305 @@ static void     poll_led_etc()
 
 static int umac_cursor_button = 0;
 
-static void     poll_umac()
+static void     poll_usb()
+{
+#if !USB_ON_CORE0
+        tuh_task();
+        hid_app_task();
+#endif
+}
+
+/* Emulated vsync follows the DVI vertical blank.  A delivery is late if it
+ * reaches umac more than VSYNC_LATE_US after the blank started, and frames
+ * that passed entirely while umac was busy are counted as missed.
+ */
+#ifndef VSYNC_LATE_US
+#define VSYNC_LATE_US   2000
+#endif
+/* Derive the 1Hz tick from the 60Hz DVI frame count instead of a timer */
+#ifndef UMAC_1HZ_FROM_VSYNC
+#define UMAC_1HZ_FROM_VSYNC     1
+#endif
+
+static volatile uint32_t vsync_missed = 0;
+static volatile uint32_t vsync_late = 0;
+
+#if EMU_STATS
+/* Running totals, each field only written by one core so the report can
+ * sample them without locking.  Rates come from differences, so wrapping
+ * is harmless.
+ */
+struct emu_stats {
+        uint32_t loops;
+        uint32_t cycles;        /* 68k cycles, as reported by Musashi */
+        uint32_t emu_us;        /* Inside umac_loop(), disc I/O included */
+        uint32_t disc_us;
+        uint32_t core0_idle_us;
+};
+
+static volatile struct emu_stats emu_stats;
+#endif
+
+static void     poll_vsync()
 {
+        static bool started = false;
+        static uint32_t last_frame = 0;
+#if UMAC_1HZ_FROM_VSYNC
+        static unsigned int frames_1hz = 0;
+#else
         static absolute_time_t last_1hz = 0;
-        static absolute_time_t last_vsync = 0;
         absolute_time_t now = get_absolute_time();
 
-        umac_loop();
+        if (absolute_time_diff_us(last_1hz, now) >= 1000000) {
+                umac_1hz_event();
+                last_1hz = now;
+        }
+#endif
 
-        int64_t p_1hz = absolute_time_diff_us(last_1hz, now);
-        int64_t p_vsync = absolute_time_diff_us(last_vsync, now);
-        if (p_vsync >= 16667) {
-                /* FIXME: Trigger this off actual vsync */
-                umac_vsync_event();
-                last_vsync = now;
+        uint32_t vblank_us;
+        uint32_t frame = video_get_vblank(&vblank_us);
+
+        if (!started) {
+                last_frame = frame;
+                started = true;
+                return;
         }
-        if (p_1hz >= 1000000) {
+        if (frame == last_frame)
+                return;
+
+        uint32_t frames = frame - last_frame;
+        last_frame = frame;
+
+        if (frames > 1)
+                vsync_missed += frames - 1;
+        if (time_us_32() - vblank_us > VSYNC_LATE_US)
+                vsync_late++;
+
+#if VIDEO_LATCH
+        video_latch_framebuffer();
+#endif
+        umac_vsync_event();
+
+#if UMAC_1HZ_FROM_VSYNC
+        frames_1hz += frames;
+        if (frames_1hz >= 60) {
+                frames_1hz -= 60;
                 umac_1hz_event();
-                last_1hz = now;
         }
+#endif
+}
+
+/* Housekeeping (vsync, 1Hz, mouse, keyboard, USB) runs after a batch of
+ * umac_loop() calls instead of after every one.  UMAC_LOOP_QUANTUM fixes the
+ * batch size; 0 resizes it after each batch so a batch takes about
+ * UMAC_POLL_US, which bounds how late events are delivered.
+ */
+#ifndef UMAC_LOOP_QUANTUM
+#define UMAC_LOOP_QUANTUM       0
+#endif
+#ifndef UMAC_POLL_US
+#define UMAC_POLL_US            500
+#endif
+#define UMAC_LOOP_QUANTUM_MAX   256
+
+/* F12 writes back the SD disc cache instead of reaching the Mac */
+#ifndef DISC_FLUSH_HOTKEY
+#define DISC_FLUSH_HOTKEY       1
+#endif
+
+/* Record disc requests; F11 dumps them to the UART and DISC_TRACE_FILE */
+#ifndef DISC_TRACE
+#define DISC_TRACE      0
+#endif
+
+static inline void      umac_step()
+{
+        umac_loop();
+#if EMU_STATS
+        /* Cycles of the m68k_execute() that umac_loop() just ran */
+        emu_stats.cycles += m68k_cycles_run();
+        emu_stats.loops++;
+#endif
+}
 
-       if(cursor_button != umac_cursor_button || (int)cursor_x != 0 || (int)cursor_y != 0)
+static void     run_umac()
+{
+#if UMAC_LOOP_QUANTUM
+#if EMU_STATS
+        uint32_t start = time_us_32();
+#endif
+        for (int i = 0; i < UMAC_LOOP_QUANTUM; i++)
+                umac_step();
+#if EMU_STATS
+        emu_stats.emu_us += time_us_32() - start;
+#endif
+#else
+        static unsigned int quantum = 1;
+        uint32_t start = time_us_32();
+
+        for (unsigned int i = 0; i < quantum; i++)
+                umac_step();
+
+        uint32_t elapsed = time_us_32() - start;
+#if EMU_STATS
+        emu_stats.emu_us += elapsed;
+#endif
+        /* Disc I/O can make one batch slow; halving recovers quickly */
+        if (elapsed < UMAC_POLL_US / 2 && quantum < UMAC_LOOP_QUANTUM_MAX)
+                quantum *= 2;
+        else if (elapsed > UMAC_POLL_US && quantum > 1)
+                quantum /= 2;
+#endif
+}
+
+/* Whole Mac pixels of movement since the last call.  total is one of hid.c's
+ * running counts, which only it writes, maybe from the other core, so rather
+ * than subtract what was used from it, the counts not yet worth a pixel are
+ * kept in *left (0 to MOUSE_DIVIDER - 1, rounding towards minus infinity).
+ */
+static int32_t  mouse_pixels(int32_t total, int32_t *seen, int32_t *left)
+{
+        int32_t d;
+
+        *left += (int32_t)((uint32_t)total - (uint32_t)*seen);  /* Safe if total wraps */
+        *seen = total;
+        d = *left / MOUSE_DIVIDER;
+        if (*left % MOUSE_DIVIDER < 0)
+                d--;
+        *left -= d * MOUSE_DIVIDER;
+        return d;
+}
+
+static void     poll_umac()
+{
+        run_umac();
+
+        poll_vsync();
+
+        static int32_t seen_x = 0, seen_y = 0, left_x = 0, left_y = 0;
+        int button = cursor_button;
+        int dx = mouse_pixels(cursor_x, &seen_x, &left_x);
+        int dy = mouse_pixels(cursor_y, &seen_y, &left_y);
+
+       if(button != umac_cursor_button || dx != 0 || dy != 0)
        {
-                umac_mouse((int)cursor_x, -(int)cursor_y, cursor_button);
-                umac_cursor_button = cursor_button;
-                cursor_x -= (int)cursor_x;
-                cursor_y -= (int)cursor_y;
+                umac_mouse(dx, -dy, button);
+                umac_cursor_button = button;
        }
 
         if (!kbd_queue_empty()) {
                 uint16_t k = kbd_queue_pop();
+#if DISC_FLUSH_HOTKEY
+                if ((k & 0xff) == KBD_MAC_KEY(MKC_F12)) {
+                        if ((k & 0x8000) && sd_disc_unsaved()) {
+                                if (sd_disc_flush() == 0)
+                                        printf("sd_disc: flushed\n");
+                                else
+                                        printf("sd_disc: flush failed, will retry\n");
+                        }
+                        return;
+                }
+#endif
+#if DISC_TRACE
+                if ((k & 0xff) == KBD_MAC_KEY(MKC_F11)) {
+                        if (k & 0x8000)
+                                disc_trace_dump(fs.fs_type ? DISC_TRACE_FILE : NULL);
+                        return;
+                }
+#endif
                 umac_kbd_event(k & 0xff, !!(k & 0x8000));
         }
 }
 
+static int      sd_do_read(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
+{
+        return sd_disc_read(data, offset, len);
+}
+
+static int      sd_do_write(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
+{
+        return sd_disc_write(data, offset, len);
+}
+
+/* Whichever disc implementation was set up, its requests come through
+ * here to be timed and traced.
+ */
+static disc_descr_t disc_ops;
+
+#if DISC_TRACE
+/* What the trace records: 0, the FatFs result if the SD card or its
+ * filesystem failed the request, else -1 (e.g. a corrupt packed image)
+ */
+static int      disc_trace_result(int ret)
+{
+        if (ret == 0)
+                return 0;
+        if (sd_disc_last_result() != FR_OK)
+                return sd_disc_last_result();
+        return -1;
+}
+#endif
+
 static int      disc_do_read(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
 {
-        FIL *fp = (FIL *)ctx;
-        f_lseek(fp, offset);
-        unsigned int did_read = 0;
-        FRESULT fr = f_read(fp, data, len, &did_read);
-        if (fr != FR_OK || len != did_read) {
-                return -1;
-        }
-        return 0;
+        uint32_t start = time_us_32();
+        int ret = disc_ops.op_read(disc_ops.op_ctx, data, offset, len);
+        uint32_t elapsed = time_us_32() - start;
+
+#if EMU_STATS
+        emu_stats.disc_us += elapsed;
+#endif
+#if DISC_TRACE
+        disc_trace_record(false, offset, len, elapsed, disc_trace_result(ret));
+#endif
+        return ret;
 }
 
 static int      disc_do_write(void *ctx, uint8_t *data, unsigned int offset, unsigned int len)
 {
-        FIL *fp = (FIL *)ctx;
-        f_lseek(fp, offset);
-        unsigned int did_write = 0;
-        FRESULT fr = f_write(fp, data, len, &did_write);
-        if (fr != FR_OK || len != did_write) {
-                return -1;
-        }
-        return 0;
+        uint32_t start = time_us_32();
+        int ret = disc_ops.op_write(disc_ops.op_ctx, data, offset, len);
+        uint32_t elapsed = time_us_32() - start;
+
+#if EMU_STATS
+        emu_stats.disc_us += elapsed;
+#endif
+#if DISC_TRACE
+        disc_trace_record(true, offset, len, elapsed, disc_trace_result(ret));
+#endif
+        return ret;
+}
+
+static void     disc_wrap_ops(disc_descr_t *disc)
+{
+        if (disc->base != 0)
+                return;         /* umac reads memory-mapped images itself */
+
+        disc_ops = *disc;
+        disc->op_read = disc_do_read;
+        disc->op_write = disc_do_write;
 }
 
 static FIL discfp;
 
+static void     flash_disc_setup(disc_descr_t *disc)
+{
+#if DISC_PACKED
+        if (disc_packed_setup(disc, umac_disc, sizeof(umac_disc)) == 0)
+                return;
+#endif
+        disc->base = (void *)umac_disc;
+        disc->read_only = 1;
+        disc->size = sizeof(umac_disc);
+}
+
+static uint32_t menu_us;
+
+static void     sd_files_setup()
+{
+        f_mkdir(SD_STATE_DIR);
+}
+
 static void     disc_setup(disc_descr_t discs[DISC_NUM_DRIVES])
 {
 
@@ -159,24 +436,34 @@ static void     disc_setup(disc_descr_t discs[DISC_NUM_DRIVES])
         if (fr != FR_OK) {
                 goto no_sd;
         }
+        sd_files_setup();
+
+        /* The start of umac_ram is on screen; after it is free until the menu indexes there */
+        sd_disc_tune_clock(&picofat_config, umac_ram + MENU_FB_BYTES, sizeof(umac_ram) - MENU_FB_BYTES);
 
-        //Open the file selector
-        init_menu(umac_ram, &fs);
+        //Open the file selector, indexing folders in the RAM after its screen
+        uint32_t menu_start = time_us_32();
+        init_menu(umac_ram, &fs, umac_ram + MENU_FB_BYTES, sizeof(umac_ram) - MENU_FB_BYTES);
         while (!process_menu(&discfp))
-        {
-                tuh_task();
-                hid_app_task();
+                poll_usb();
+        menu_us = time_us_32() - menu_start;
+
+        if(discfp.err == 0xFF) {
+                flash_disc_setup(&discs[0]);
+#if DISC_OVERLAY
+                disc_overlay_setup(&discs[0], DISC_OVERLAY_FILE, &discfp, &picofat_config);
+#endif
+                return;
         }
 
-        if(discfp.err == 0xFF)
-                goto no_sd;
+        sd_disc_open(&discfp, &picofat_config);
 
         discs[0].base = 0; // Means use R/W ops
         discs[0].read_only = false;
         discs[0].size = f_size(&discfp);
         discs[0].op_ctx = &discfp;
-        discs[0].op_read = disc_do_read;
-        discs[0].op_write = disc_do_write;
+        discs[0].op_read = sd_do_read;
+        discs[0].op_write = sd_do_write;
 
         return;
 
@@ -185,29 +472,81 @@ no_sd:
         /* If we don't find an SD-based image, attempt
          * to use in-flash disc image:
          */
-        discs[0].base = (void *)umac_disc;
-        discs[0].read_only = 1;
-        discs[0].size = sizeof(umac_disc);
+        flash_disc_setup(&discs[0]);
 }
 
 static void     core1_main()
 {
         disc_descr_t discs[DISC_NUM_DRIVES] = {0};
 
+#if !USB_ON_CORE0
         tusb_init();
+#endif
 
         disc_setup(discs);
+        disc_wrap_ops(&discs[0]);
 
+        /* The timer starts at reset */
+        printf("boot: %lu ms from reset to umac_init, %lu ms of it in the menu\n",
+               time_us_32() / 1000, menu_us / 1000);
         umac_init(umac_ram, (void *)umac_rom, discs);
         set_framebuffer((uint8_t *)(umac_ram + umac_get_fb_offset()));
 
         while (true) {
                 poll_umac();
-                tuh_task();
-                hid_app_task();
+                poll_usb();
+                sd_disc_poll();
         }
 }
 
+#if EMU_STATS
+static void     print_emu_stats(uint32_t elapsed_us)
+{
+        static struct emu_stats last;
+        struct emu_stats now = emu_stats;
+        uint32_t elapsed_ms = elapsed_us / 1000;
+        char line[81];
+
+        uint32_t khz = (now.cycles - last.cycles) / elapsed_ms;
+        uint32_t disc_us = now.disc_us - last.disc_us;
+        uint32_t emu_us = now.emu_us - last.emu_us - disc_us;
+
+        /* A real Mac 128K/Plus 68000 runs at 7.8336MHz */
+        snprintf(line, sizeof(line), "68k %lu.%02luMHz (%lu%%) %lu loops/s core1 %lu%% emu %lu%% disc core0 %lu%% idle",
+                 khz / 1000, (khz % 1000) / 10, khz * 100 / 7834,
+                 (now.loops - last.loops) * 1000 / elapsed_ms,
+                 emu_us / (elapsed_us / 100), disc_us / (elapsed_us / 100),
+                 (now.core0_idle_us - last.core0_idle_us) / (elapsed_us / 100));
+
+        printf("emu: %s, vsync %lu missed %lu late\n", line, vsync_missed, vsync_late);
+        sd_disc_print_stats();
+#if VIDEO_OVERLAY
+        video_set_overlay(line);
+#endif
+        last = now;
+}
+#endif
+
+#if VIDEO_PROFILE || EMU_STATS
+static void     poll_stats()
+{
+        static absolute_time_t last = 0;
+        absolute_time_t now = get_absolute_time();
+        int64_t elapsed = absolute_time_diff_us(last, now);
+
+        if (elapsed < STATS_INTERVAL_MS * 1000)
+                return;
+
+#if VIDEO_PROFILE
+        video_print_stats();
+#endif
+#if EMU_STATS
+        print_emu_stats((uint32_t)elapsed);
+#endif
+        last = now;
+}
+#endif
+
 int main()
 {
         memset(umac_ram, 0xFA, 128 * 1024);
@@ -215,12 +554,35 @@ int main()
         video_init();
         set_framebuffer(umac_ram);
 
+#if USB_ON_CORE0
+        tusb_init();
+#endif
+
         //Launch main code
         multicore_launch_core1(core1_main);
 
-        //Infinite loop
-	while(true)
+        //Infinite loop, woken by DVI and USB interrupts
+	while(true) {
+#if EMU_STATS
+                /* Wake with interrupts masked so the handler time isn't
+                 * counted as idle, then let it run.
+                 */
+                uint32_t irq = save_and_disable_interrupts();
+                uint32_t start = time_us_32();
+                __wfi();
+                emu_stats.core0_idle_us += time_us_32() - start;
+                restore_interrupts(irq);
+#else
                 __wfi();
+#endif
+#if USB_ON_CORE0
+                tuh_task();
+                hid_app_task();
+#endif
+#if VIDEO_PROFILE || EMU_STATS
+                poll_stats();
+#endif
+        }
                 
 	return 0;
 }
@@ -1,16 +1,44 @@
 #include "menu.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <math.h>
-#include "font_8x8.h"
+#include "font_8x8_rev.h"
 #include "kbd.h"
 #include "keymap.h"
 #include "tf_card.h"
 #include "ff.h"
+#include "pico/time.h"
+#include "sd_files.h"
+
+//Keep each folder's index in a catalog file on the card (0 disables)
+#ifndef MENU_CATALOG
+#define MENU_CATALOG 1
+#endif
+
+#define MENU_CATALOG_MAGIC 0x58444955 //"UIDX"
+
+//Seconds to wait before booting the last image picked (0 disables)
+#ifndef MENU_AUTOBOOT_S
+#define MENU_AUTOBOOT_S 3
+#endif
+
+//Saved as the last image when Esc picked the flash image (not a path)
+#define MENU_LAST_FLASH "(flash image)"
 
 static FATFS* fs;
 uint8_t* buffer;
 
-#define PAGE_SIZE (COLS * ROWS)
+//Text on screen, and the text wanted. Rows marked dirty are compared
+//and only the cells that differ are drawn.
+static char* text;
+static char* screen;
+static uint64_t dirty_rows;
+
+//Two columns of ITEM_ROWS entries
+#define PAGE_SIZE (ITEM_ROWS * 2)
 
 uint32_t current_page = 0;
 uint32_t current_entry = 0;
@@ -21,26 +49,123 @@ DIR current_dir;
 FILINFO current_file;
 char current_path[256];
 
+//Index of the current folder, built in one pass when it's opened so
+//paging and selection never go back to the card. Entries are packed up
+//from the start of the arena and a table of their offsets grows down
+//from the end, so entry n is a lookup. Once built, the table is sorted
+//and the entries shown (those matching the type-ahead filter) are
+//listed in a view table just after the records.
+typedef struct
+{
+    uint32_t size;
+    uint8_t is_folder;
+    char name[];
+} menu_entry_t;
+
+static uint8_t* arena;
+static uint32_t arena_size;
+static uint32_t arena_used;
+static uint32_t indexed_entries;
+static bool index_complete;
+
+static uint32_t* view;
+static uint32_t view_entries;
+
+//Type-ahead filter, matched anywhere in the name ignoring case
+#define FILTER_MAX 24
+static char filter[FILTER_MAX + 1];
+static uint8_t filter_len;
+
+//The index shown may have come from the catalog, so the folder is
+//rescanned one entry per idle poll while the menu is up. The entry
+//count and an order independent checksum are compared at the end.
+static bool verifying;
+static uint32_t verify_count;
+static uint32_t verify_sum;
+
+//Last image picked, booted when the countdown runs out
+static char last_path[sizeof(current_path)];
+static bool autoboot;
+static uint32_t autoboot_start;
+static uint32_t autoboot_shown;
 
-//Reverse byte (MAC screen has bits reversed)
-unsigned char reverse(unsigned char b) {
-   b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-   b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-   b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-   return b;
-}
 
 //Print a char in the screen
+//Only the text grid is updated, draw_text() puts the changes on screen
 void print_char(const char c, uint16_t x, uint16_t y)
 {
-    uint16_t pos = y * 9 * STRIDE + x;
-    uint16_t ch = c - FONT_FIRST_ASCII;
+    if(x >= COLS || y >= ROWS)
+        return;
+
+    text[y * COLS + x] = c;
+    dirty_rows |= 1ull << y;
+}
+
+//Blank the whole text grid
+static void clear_text()
+{
+    memset(text, ' ', ROWS * COLS);
+    dirty_rows = (1ull << ROWS) - 1;
+}
+
+//Draw cells [start, end) of a text row, a glyph line of them at a time,
+//four cells per word store where aligned
+static void draw_run(uint16_t y, uint16_t start, uint16_t end)
+{
+    const uint8_t* glyph[COLS];
+    uint8_t* line = buffer + y * 9 * STRIDE;
+
+    for(uint16_t x = start; x < end; x++)
+    {
+        uint8_t ch = (uint8_t)text[y * COLS + x] - FONT_FIRST_ASCII;
+        if(ch >= FONT_N_CHARS)
+            ch = '?' - FONT_FIRST_ASCII;
 
-    for(uint8_t i = 0; i < 8; i++)
+        glyph[x] = font_8x8_rev[ch];
+        screen[y * COLS + x] = text[y * COLS + x];
+    }
+
+    for(uint8_t i = 0; i < FONT_CHAR_HEIGHT; i++, line += STRIDE)
     {
-        buffer[pos] = reverse(font_8x8[ch]);
-        ch += FONT_N_CHARS;
-        pos += STRIDE;
+        uint16_t x = start;
+
+        for(; x < end && (x & 3); x++)
+            line[x] = glyph[x][i];
+
+        for(; x + 4 <= end; x += 4)
+            *(uint32_t*)(line + x) = glyph[x][i] | glyph[x + 1][i] << 8 |
+                                     glyph[x + 2][i] << 16 | (uint32_t)glyph[x + 3][i] << 24;
+
+        for(; x < end; x++)
+            line[x] = glyph[x][i];
+    }
+}
+
+//Draw the cells that differ from what's on screen
+static void draw_text()
+{
+    for(uint16_t y = 0; dirty_rows; y++, dirty_rows >>= 1)
+    {
+        if(!(dirty_rows & 1))
+            continue;
+
+        const char* want = text + y * COLS;
+        const char* have = screen + y * COLS;
+        uint16_t x = 0;
+
+        while(x < COLS)
+        {
+            while(x < COLS && want[x] == have[x])
+                x++;
+
+            uint16_t start = x;
+
+            while(x < COLS && want[x] != have[x])
+                x++;
+
+            if(start < x)
+                draw_run(y, start, x);
+        }
     }
 }
 
@@ -89,29 +214,339 @@ void select_entry(uint8_t entry)
     col = current_entry >= ITEM_ROWS ? 32 : 0;
 
     print_char('>', col, row);
+    draw_text();
 }
 
-//Seeks in the directory for an entry based on its index, leaves the DIR ready for READDIR
-void seek_entry(uint32_t page, uint32_t entry)
+//Offset table slot for an entry, counting down from the arena end
+static uint32_t* entry_slot(uint32_t index)
 {
-    f_rewinddir(&current_dir);
-    uint32_t seeks = page * PAGE_SIZE + entry;
+    return (uint32_t*)(arena + arena_size) - 1 - index;
+}
 
-    //First entry is our fake "..", second entry is entry 0 (no seek needed)
-    if(seeks < 2)
+//Get an indexed entry, in sorted order once the index is built
+static menu_entry_t* get_entry(uint32_t index)
+{
+    return (menu_entry_t*)(arena + *entry_slot(index));
+}
+
+//Get a shown entry (0 is the first real entry, after "..")
+menu_entry_t* get_view_entry(uint32_t index)
+{
+    return (menu_entry_t*)(arena + view[index]);
+}
+
+//Bytes an index record takes, kept word aligned
+static uint32_t record_len(const char* name)
+{
+    return (sizeof(menu_entry_t) + strlen(name) + 1 + 3) & ~3;
+}
+
+//Add a directory entry to the index, false if the arena is full
+static bool index_entry(const FILINFO* info)
+{
+    uint32_t len = record_len(info->fname);
+
+    //Leave room for a view slot per entry as well
+    uint32_t tables = (indexed_entries + 1) * sizeof(uint32_t);
+
+    if(arena_used + len + tables > (uint8_t*)entry_slot(indexed_entries) - arena)
+        return false;
+
+    menu_entry_t* entry = (menu_entry_t*)(arena + arena_used);
+    entry->size = info->fsize;
+    entry->is_folder = (info->fattrib & AM_DIR) != 0;
+    strcpy(entry->name, info->fname);
+
+    *entry_slot(indexed_entries) = arena_used;
+    arena_used += len;
+    indexed_entries++;
+    return true;
+}
+
+//Entries the menu lists (our own folder in the root is left out)
+static bool listed(const FILINFO* info)
+{
+    return strcmp(current_path, "/") != 0 || strcasecmp(info->fname, SD_STATE_DIR + 1) != 0;
+}
+
+//Hash (FNV-1a) of an entry for the rescan checksum
+static uint32_t entry_hash(const char* name, uint32_t size, bool is_folder)
+{
+    uint32_t hash = 2166136261u;
+
+    while(*name)
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+
+    return (hash ^ size) * 16777619u + is_folder;
+}
+
+//Read the whole folder into the index
+static void scan_folder(const char* path)
+{
+    arena_used = 0;
+    indexed_entries = 0;
+    index_complete = false;
+
+    if(f_opendir(&current_dir, path) != FR_OK)
         return;
 
-    seeks--; //Reduce one the number of seeks
+    while (f_readdir(&current_dir, &current_file) == FR_OK)
+    {
+        if(current_file.fname[0] == 0)
+        {
+            index_complete = true;
+            break;
+        }
+
+        if(listed(&current_file) && !index_entry(&current_file))
+        {
+            printf("menu: index full, showing %lu entries\n", indexed_entries);
+            break;
+        }
+    }
+
+    f_closedir(&current_dir);
+}
+
+#if MENU_CATALOG
+typedef struct
+{
+    uint32_t magic;
+    uint32_t entries;
+    uint32_t bytes;
+    char path[sizeof(current_path)];
+} catalog_header_t;
+
+static catalog_header_t catalog_header;
+
+//Catalog file of a folder, named by a hash of its path
+static void catalog_name(const char* path, char* name)
+{
+    sprintf(name, MENU_CATALOG_DIR "/%08lx.idx", entry_hash(path, 0, false));
+}
+
+//Fill the index from the folder's catalog, false if there isn't one
+static bool load_catalog(const char* path)
+{
+    FIL fp;
+    char name[32];
+    unsigned int did_read = 0;
+
+    catalog_name(path, name);
+    if(f_open(&fp, name, FA_READ) != FR_OK)
+        return false;
+
+    f_read(&fp, &catalog_header, sizeof(catalog_header), &did_read);
+
+    if(did_read != sizeof(catalog_header) ||
+       catalog_header.magic != MENU_CATALOG_MAGIC ||
+       memchr(catalog_header.path, 0, sizeof(catalog_header.path)) == NULL ||
+       strcmp(catalog_header.path, path) != 0 ||
+       //Each field on its own first, so a corrupt one can't wrap the sum
+       catalog_header.entries > arena_size / (2 * sizeof(uint32_t)) ||
+       catalog_header.bytes > arena_size - catalog_header.entries * 2 * sizeof(uint32_t))
+    {
+        f_close(&fp);
+        return false;
+    }
+
+    f_read(&fp, arena, catalog_header.bytes, &did_read);
+    f_close(&fp);
+
+    if(did_read != catalog_header.bytes)
+        return false;
+
+    //Rebuild the offset table by walking the records, each name ending
+    //inside what was read
+    arena_used = 0;
+    for(indexed_entries = 0; indexed_entries < catalog_header.entries; indexed_entries++)
+    {
+        uint32_t name = arena_used + sizeof(menu_entry_t);
+
+        if(name >= catalog_header.bytes ||
+           memchr(arena + name, 0, catalog_header.bytes - name) == NULL)
+            break;
+
+        *entry_slot(indexed_entries) = arena_used;
+        arena_used += record_len(get_entry(indexed_entries)->name);
+    }
+
+    //A truncated or corrupt catalog doesn't add up; scan the folder instead
+    if(arena_used != catalog_header.bytes || indexed_entries != catalog_header.entries)
+        return false;
+
+    index_complete = true;
+    return true;
+}
+
+//Write the index out as the folder's catalog
+static void save_catalog(const char* path)
+{
+    FIL fp;
+    char name[32];
+    unsigned int did_write;
+
+    //A truncated index would never match the folder
+    if(!index_complete)
+        return;
+
+    f_mkdir(SD_STATE_DIR);
+    f_mkdir(MENU_CATALOG_DIR);
+
+    catalog_name(path, name);
+    if(f_open(&fp, name, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return;
+
+    memset(&catalog_header, 0, sizeof(catalog_header));
+    catalog_header.magic = MENU_CATALOG_MAGIC;
+    catalog_header.entries = indexed_entries;
+    catalog_header.bytes = arena_used;
+    strcpy(catalog_header.path, path);
+
+    f_write(&fp, &catalog_header, sizeof(catalog_header), &did_write);
+    f_write(&fp, arena, arena_used, &did_write);
+    f_close(&fp);
+}
+#else
+static bool load_catalog(const char* path) { return false; }
+static void save_catalog(const char* path) { }
+#endif
+
+//Folders first, then by name ignoring case
+static int compare_entries(const void* a, const void* b)
+{
+    const menu_entry_t* ea = (const menu_entry_t*)(arena + *(const uint32_t*)a);
+    const menu_entry_t* eb = (const menu_entry_t*)(arena + *(const uint32_t*)b);
+
+    if(ea->is_folder != eb->is_folder)
+        return eb->is_folder - ea->is_folder;
+
+    return strcasecmp(ea->name, eb->name);
+}
+
+//Sort the index, once per build. The offset table runs backwards in
+//memory, so sorting it descending puts entry 0 first.
+static int compare_entries_reversed(const void* a, const void* b)
+{
+    return compare_entries(b, a);
+}
+
+static void sort_index()
+{
+    if(indexed_entries > 1)
+        qsort(entry_slot(indexed_entries - 1), indexed_entries, sizeof(uint32_t), compare_entries_reversed);
+}
+
+//Does a name contain the filter (ignoring case)?
+static bool filter_match(const char* name)
+{
+    for(; *name; name++)
+    {
+        uint8_t i = 0;
+        while(i < filter_len && tolower((uint8_t)name[i]) == filter[i])
+            i++;
+
+        if(i == filter_len)
+            return true;
+    }
+
+    return filter_len == 0;
+}
+
+//Narrow the view to the entries matching the filter. Adding a letter
+//only needs the entries already shown to be checked again; otherwise
+//start from the whole index.
+static void filter_view(bool narrow)
+{
+    uint32_t count = 0;
+
+    view = (uint32_t*)(arena + arena_used);
+
+    if(narrow)
+    {
+        for(uint32_t i = 0; i < view_entries; i++)
+            if(filter_match(get_view_entry(i)->name))
+                view[count++] = view[i];
+    }
+    else
+    {
+        for(uint32_t i = 0; i < indexed_entries; i++)
+            if(filter_match(get_entry(i)->name))
+                view[count++] = *entry_slot(i);
+    }
+
+    view_entries = count;
+}
+
+//Start checking the index against the folder
+static void start_verify(const char* path)
+{
+    verifying = f_opendir(&current_dir, path) == FR_OK;
+    verify_count = 0;
+    verify_sum = 0;
+}
+
+//Stop checking
+static void end_verify()
+{
+    f_closedir(&current_dir);
+    verifying = false;
+}
+
+//Check the next folder entry against the index
+//Returns true when checking ends having rebuilt the index
+static bool verify_step()
+{
+    if(!verifying)
+        return false;
+
+    if(f_readdir(&current_dir, &current_file) == FR_OK && current_file.fname[0] != 0)
+    {
+        if(listed(&current_file))
+        {
+            verify_count++;
+            verify_sum += entry_hash(current_file.fname, current_file.fsize,
+                                     (current_file.fattrib & AM_DIR) != 0);
+        }
+        return false;
+    }
+
+    end_verify();
 
-    while(seeks--)
-        f_readdir(&current_dir, &current_file);
+    uint32_t sum = 0;
+    for(uint32_t i = 0; i < indexed_entries; i++)
+    {
+        menu_entry_t* entry = get_entry(i);
+        sum += entry_hash(entry->name, entry->size, entry->is_folder);
+    }
+
+    if(verify_count == indexed_entries && verify_sum == sum)
+        return false;
+
+    //The folder changed since the catalog was saved
+    scan_folder(current_path);
+    sort_index();
+    save_catalog(current_path);
+    filter_view(false);
+    return true;
+}
+
+//Check the rest of the folder at once
+static bool verify_all()
+{
+    bool changed = false;
+
+    while(verifying)
+        changed = verify_step();
+
+    return changed;
 }
 
 //Read a page of entries
 void read_page()
 {
-    //Erase video memory
-    memset(buffer, 0, (VIDEO_FB_HRES * VIDEO_FB_VRES) / 8);
+    //Start from a blank page, only what differs gets drawn
+    clear_text();
 
     //Add headers
     print_string("IMAGE SELECTOR", COLS / 2 - 7, 1);
@@ -119,6 +554,19 @@ void read_page()
     print_string("PATH: ", 1, 3);
     print_string(current_path, 6, 3);
 
+    if(autoboot)
+    {
+        char line[16];
+        snprintf(line, sizeof line, "BOOT IN %lus: ", MENU_AUTOBOOT_S - autoboot_shown);
+        print_string(line, 1, 4);
+        print_string(last_path, 1 + strlen(line), 4);
+    }
+    else if(filter_len)
+    {
+        print_string("FIND: ", 1, 4);
+        print_string(filter, 7, 4);
+    }
+
     //Reset entry info
     current_entry = 0;
     entry_count = 0;
@@ -129,48 +577,66 @@ void read_page()
     //Populate entries
     for(int buc = 0; buc < entries_in_page; buc++)
     {
+        uint32_t index = current_page * PAGE_SIZE + buc;
+
         //Add ".. as the first entry of the first page"
-        if(buc == 0 && current_page == 0)
+        if(index == 0)
         {
             add_menu_entry("..", true);
         }
         else
         {
-            if(f_readdir(&current_dir, &current_file) == FR_OK)
-                add_menu_entry(current_file.fname, current_file.fattrib & AM_DIR);
+            menu_entry_t* entry = get_view_entry(index - 1);
+            add_menu_entry(entry->name, entry->is_folder);
         }
     }
 
     select_entry(0);
 }
 
+//Recount pages after the view changed, and redraw
+static void refresh_page()
+{
+    //Add one entry for ".."
+    total_entries = view_entries + 1;
+
+    //Calculate total pages in this folder
+    total_pages = ceil((double)total_entries / (double)PAGE_SIZE);
+
+    if(current_page >= total_pages)
+        current_page = 0;
+
+    read_page();
+}
+
 //Open specified folder
 void open_folder(char* path)
 {
     //Assume filesystem is already initialized
-    f_opendir(&current_dir, path);
-    total_entries = 0;
-    current_page = 0;
-    current_entry = 0;
+    if(verifying)
+        end_verify();
 
-    while (f_readdir(&current_dir, &current_file) == FR_OK)
+    //Show the catalog straight away and check it while idle, or scan
+    //the folder now if there's none
+    if(load_catalog(path))
+        start_verify(path);
+    else
     {
-        if(current_file.fname[0] == 0)
-            break;
-        
-        total_entries++;
+        scan_folder(path);
+        save_catalog(path);
     }
-    
-    f_rewinddir(&current_dir);
 
-    //Add one entry for ".."
-    total_entries++;
+    sort_index();
 
-    //Calculate total pages in this folder
-    total_pages = ceil((double)total_entries / (double)PAGE_SIZE);
+    filter_len = 0;
+    filter[0] = 0;
+    filter_view(false);
+
+    current_page = 0;
+    current_entry = 0;
 
     //Read first page of the folder
-    read_page();
+    refresh_page();
 }
 
 //Move to the next page in the current folder
@@ -181,11 +647,6 @@ void next_page()
     if(current_page >= total_pages)
         current_page = 0;
 
-    //In this case the seek could be skipped or replaced by a rewind
-    //depending on the case, but for clarity both next/prev functions
-    //use the same code.
-    seek_entry(current_page, 0);
-    
     read_page();
 }
 
@@ -196,26 +657,121 @@ void prev_page()
 
     if(current_page >= total_pages)
         current_page = total_pages - 1;
-    
-    //Search for the first entry in the page
-    seek_entry(current_page, 0);
 
     read_page();
 }
 
+//Read the last image picked, false if there's none or it's gone
+static bool load_last()
+{
+    FIL fp;
+    unsigned int did_read = 0;
+
+    if(f_open(&fp, MENU_LAST_FILE, FA_READ) != FR_OK)
+        return false;
+    f_read(&fp, last_path, sizeof(last_path) - 1, &did_read);
+    f_close(&fp);
+    last_path[did_read] = 0;
+
+    if(strcmp(last_path, MENU_LAST_FLASH) == 0)
+        return true;
+
+    return did_read && f_stat(last_path, &current_file) == FR_OK &&
+           !(current_file.fattrib & AM_DIR);
+}
+
+//Remember the image picked, if it's not the one already remembered
+static void save_last(const char* path)
+{
+    FIL fp;
+    unsigned int did_write;
+
+    if(strcmp(path, last_path) == 0)
+        return;
+
+    if(f_open(&fp, MENU_LAST_FILE, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return;
+    f_write(&fp, path, strlen(path), &did_write);
+    f_close(&fp);
+}
+
 //Initialize menu
-void init_menu(uint8_t* fb, FATFS* filesystem)
+void init_menu(uint8_t* fb, FATFS* filesystem, uint8_t* index_arena, uint32_t index_size)
 {
     //Store variables
     buffer = fb;
     fs = filesystem;
+    //The text grids come first in the scratch RAM
+    text = (char*)index_arena;
+    screen = text + ROWS * COLS;
+    arena = index_arena + 2 * ROWS * COLS;
+    arena_size = (index_size - 2 * ROWS * COLS) & ~3;
+
+    //Clear the screen once, later pages just redraw the cells changed
+    memset(buffer, 0, MENU_FB_BYTES);
+    memset(screen, ' ', ROWS * COLS);
     
     //Initialize path to "/"
     current_path[0] = '/';
     current_path[1] = 0;
 
+    //Count down to booting the last image, unless a key is pressed
+    autoboot = MENU_AUTOBOOT_S > 0 && load_last();
+    autoboot_shown = 0;
+
     //Open root folder
     open_folder(current_path);
+
+    //The countdown starts once it's on screen, however long the scan took
+    autoboot_start = time_us_32();
+}
+
+//Run the auto-boot countdown, true once the last image is opened
+static bool poll_autoboot(FIL* file)
+{
+    //Any key stops it and leaves the menu up
+    if(!kbd_queue_empty())
+    {
+        kbd_queue_pop();
+        autoboot = false;
+        read_page();
+        return false;
+    }
+
+    uint32_t elapsed = (time_us_32() - autoboot_start) / 1000000;
+
+    if(elapsed < MENU_AUTOBOOT_S)
+    {
+        if(elapsed != autoboot_shown)
+        {
+            autoboot_shown = elapsed;
+            read_page();
+        }
+        return false;
+    }
+
+    autoboot = false;
+
+    if(strcmp(last_path, MENU_LAST_FLASH) == 0)
+    {
+        if(verifying)
+            end_verify();
+        printf("menu: booting the flash image\n");
+        file->err = 0xFF;
+        return true;
+    }
+
+    if(f_open(file, last_path, FA_OPEN_EXISTING | FA_READ | FA_WRITE) != FR_OK)
+    {
+        read_page();
+        return false;
+    }
+
+    if(verifying)
+        end_verify();
+
+    printf("menu: booting %s\n", last_path);
+    return true;
 }
 
 
@@ -241,11 +797,40 @@ void next_folder(char* new_path)
     open_folder(current_path);
 }
 
+//Character a key adds to the type-ahead filter, 0 for none
+static char filter_char(uint8_t key)
+{
+    static const struct { uint8_t key; char c; } keys[] =
+    {
+        {MKC_A, 'a'}, {MKC_B, 'b'}, {MKC_C, 'c'}, {MKC_D, 'd'}, {MKC_E, 'e'},
+        {MKC_F, 'f'}, {MKC_G, 'g'}, {MKC_H, 'h'}, {MKC_I, 'i'}, {MKC_J, 'j'},
+        {MKC_K, 'k'}, {MKC_L, 'l'}, {MKC_M, 'm'}, {MKC_N, 'n'}, {MKC_O, 'o'},
+        {MKC_P, 'p'}, {MKC_Q, 'q'}, {MKC_R, 'r'}, {MKC_S, 's'}, {MKC_T, 't'},
+        {MKC_U, 'u'}, {MKC_V, 'v'}, {MKC_W, 'w'}, {MKC_X, 'x'}, {MKC_Y, 'y'},
+        {MKC_Z, 'z'}, {MKC_0, '0'}, {MKC_1, '1'}, {MKC_2, '2'}, {MKC_3, '3'},
+        {MKC_4, '4'}, {MKC_5, '5'}, {MKC_6, '6'}, {MKC_7, '7'}, {MKC_8, '8'},
+        {MKC_9, '9'}, {MKC_Period, '.'}, {MKC_Minus, '-'}, {MKC_Space, ' '},
+    };
+
+    for(uint8_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+        if(keys[i].key == key)
+            return keys[i].c;
+
+    return 0;
+}
+
 //PRocess menu actions
 bool process_menu(FIL* file)
 {
+    if(autoboot && poll_autoboot(file))
+        return true;
+
     if(kbd_queue_empty())
+    {
+        if(verify_step())
+            refresh_page();
         return false;
+    }
 
     uint16_t key = kbd_queue_pop();
 
@@ -299,23 +884,33 @@ bool process_menu(FIL* file)
         case MKC_Enter:
         case MKC_Return:
 
+            //The entry must match what's on the card before acting on it
+            if(verify_all())
+            {
+                refresh_page();
+                break;
+            }
+
             if(current_page == 0 && current_entry == 0)
             {
-                f_closedir(&current_dir);
                 prev_folder();
             }
             else
             {
-                
-                seek_entry(current_page, current_entry);
-                f_readdir(&current_dir, &current_file);
-                f_closedir(&current_dir);
+                menu_entry_t* entry = get_view_entry(current_page * PAGE_SIZE + current_entry - 1);
 
-                if(current_file.fattrib & AM_DIR)
-                    next_folder(current_file.fname);
+                if(entry->is_folder)
+                    next_folder(entry->name);
                 else
                 {
-                    f_open(file, strcat(current_path, current_file.fname), FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+                    //Root is "/", folders have no trailing slash
+                    if(strcmp(current_path, "/") != 0)
+                        strcat(current_path, "/");
+                    if(f_open(file, strcat(current_path, entry->name), FA_OPEN_EXISTING | FA_READ | FA_WRITE) == FR_OK)
+                        save_last(current_path);
+
+                    if(verifying)
+                        end_verify();
                     return true;
                 }
 
@@ -326,9 +921,42 @@ bool process_menu(FIL* file)
         //Esc cancels selection (defaults to embedded flash image)
         case MKC_Escape:
 
-            f_closedir(&current_dir);
+            if(verifying)
+                end_verify();
+            save_last(MENU_LAST_FLASH);
             file->err = 0xFF;
             return true;
+
+        //Backspace widens the type-ahead filter again
+        case MKC_BackSpace:
+
+            if(filter_len)
+            {
+                filter[--filter_len] = 0;
+                filter_view(false);
+                current_page = 0;
+                refresh_page();
+            }
+
+            break;
+
+        //Letters, digits and the like narrow the listing to the names
+        //containing what's been typed
+        default:
+        {
+            char c = filter_char(val);
+
+            if(c && filter_len < FILTER_MAX)
+            {
+                filter[filter_len++] = c;
+                filter[filter_len] = 0;
+                filter_view(true);
+                current_page = 0;
+                refresh_page();
+            }
+
+            break;
+        }
     }
 
     return false;
@@ -0,0 +1,859 @@
+/* SD card disc image access
+ *
+ * Requests from the Sony driver are split into 512 byte sectors and
+ * served from a small LRU cache where possible.  Writes are held in the
+ * cache (write-back) and go out in ascending runs of adjacent sectors when
+ * too many are dirty, or from sd_disc_poll() once the disc has been idle
+ * for DISC_IDLE_MS or DISC_FLUSH_MS after the first unsaved write, which
+ * also syncs the card.  After a failed flush, polls wait DISC_FLUSH_MS
+ * before trying again.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pico/time.h"
+#include "hardware/clocks.h"
+#include "diskio.h"
+#include "sd_disc.h"
+#include "sd_spi.h"
+#include "sd_files.h"
+
+/* Cached sectors.  The RAM comes out of whatever umac_ram (MEMSIZE)
+ * leaves free, so the link fails if this is too big.
+ */
+#ifndef DISC_CACHE_SECTORS
+#define DISC_CACHE_SECTORS      16
+#endif
+#if DISC_CACHE_SECTORS < 1
+#error "DISC_CACHE_SECTORS must be at least 1"
+#endif
+/* Requests bigger than this (bytes) don't fill the cache, so a long
+ * sequential read can't flush out the hot catalog/bitmap blocks.
+ */
+#ifndef DISC_CACHE_FILL_MAX
+#define DISC_CACHE_FILL_MAX     4096
+#endif
+#ifndef DISC_FLUSH_MS
+#define DISC_FLUSH_MS           1000
+#endif
+#ifndef DISC_IDLE_MS
+#define DISC_IDLE_MS            100
+#endif
+/* Bound on dirty cached sectors, i.e. on what a power cut can lose */
+#ifndef DISC_DIRTY_MAX
+#define DISC_DIRTY_MAX          (DISC_CACHE_SECTORS / 2)
+#endif
+/* Longest run of adjacent dirty sectors written with one command */
+#ifndef DISC_WRITE_RUN
+#define DISC_WRITE_RUN          8
+#endif
+/* Words of FatFs fast-seek cluster link map: 2 per fragment, plus 1 */
+#ifndef DISC_CLMT_WORDS
+#define DISC_CLMT_WORDS         64
+#endif
+/* Access a contiguous image by LBA, bypassing FatFs (needs fast seek) */
+#ifndef DISC_RAW
+#define DISC_RAW                1
+#endif
+/* In raw mode, move sector runs with our own CMD18/CMD25 + DMA transfers */
+#ifndef DISC_SPI_DMA
+#define DISC_SPI_DMA            1
+#endif
+/* Benchmark the raw path at startup (rewrites image sectors in place) */
+#ifndef DISC_BENCH
+#define DISC_BENCH              0
+#endif
+
+/* Sectors fetched ahead when reads run sequentially; 0 disables */
+#ifndef DISC_READAHEAD
+#define DISC_READAHEAD          8
+#endif
+
+/* Probe the fastest reliable SD clock at startup, up to SD_TUNE_MAX_MHZ */
+#ifndef SD_TUNE
+#define SD_TUNE                 1
+#endif
+#ifndef SD_TUNE_MAX_MHZ
+#define SD_TUNE_MAX_MHZ         63      /* RP2040 SPI master limit is clk_peri/2, ~62.5 in spec */
+#endif
+#define SD_TUNE_MIN_HZ          4000000
+#define SD_TUNE_SAFE_HZ         10000000
+#define SD_TUNE_SECTORS         32
+
+/* Card type bit from MMC_GET_TYPE, as in ChaN's MMC drivers */
+#ifndef CT_BLOCK
+#define CT_BLOCK                0x08
+#endif
+
+static FIL *disc_fp;
+#if FF_USE_FASTSEEK
+static DWORD disc_clmt[DISC_CLMT_WORDS];
+#elif DISC_RAW || DISC_SPI_DMA
+/* Raw and DMA access find the image's sectors from the link map */
+#warning "FF_USE_FASTSEEK is 0 in ffconf.h: SD disc images go through FatFs only, DISC_RAW and DISC_SPI_DMA have no effect"
+#endif
+
+/* Raw mode: the image occupies card sectors disc_lba onwards */
+static bool disc_raw = false;
+static bool disc_spi = false;
+static BYTE disc_pdrv;
+static LBA_t disc_lba;
+
+static uint32_t disc_sectors;
+
+static uint32_t stat_hits = 0;
+static uint32_t stat_misses = 0;
+static uint32_t stat_writebacks = 0;
+static uint32_t stat_write_runs = 0;
+#if DISC_READAHEAD > 0
+static uint32_t stat_ra_fetched = 0;
+static uint32_t stat_ra_hits = 0;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Sector backend
+
+/* Why the last request failed, in FatFs' terms, for the disc trace */
+static FRESULT last_result = FR_OK;
+
+/* Note a backend failure; returns -1 for the caller to pass on */
+static int      backend_fail(FRESULT fr)
+{
+        last_result = fr;
+        return -1;
+}
+
+/* A disk driver error as FatFs would report it */
+static int      backend_fail_dr(DRESULT dr)
+{
+        if (dr == RES_NOTRDY)
+                return backend_fail(FR_NOT_READY);
+        if (dr == RES_WRPRT)
+                return backend_fail(FR_WRITE_PROTECTED);
+        if (dr == RES_PARERR)
+                return backend_fail(FR_INVALID_PARAMETER);
+        return backend_fail(FR_DISK_ERR);
+}
+
+static int      backend_read(uint32_t sector, uint8_t *buf, unsigned int count)
+{
+        if (disc_spi)
+                return sd_spi_read(disc_lba + sector, buf, count) == 0 ? 0 : backend_fail(FR_DISK_ERR);
+        if (disc_raw) {
+                DRESULT dr = disk_read(disc_pdrv, buf, disc_lba + sector, count);
+
+                return dr == RES_OK ? 0 : backend_fail_dr(dr);
+        }
+
+        unsigned int len = count * SD_DISC_SECTOR_SIZE;
+        unsigned int did_read = 0;
+        FRESULT fr;
+
+        if ((fr = f_lseek(disc_fp, (FSIZE_t)sector * SD_DISC_SECTOR_SIZE)) != FR_OK ||
+            (fr = f_read(disc_fp, buf, len, &did_read)) != FR_OK)
+                return backend_fail(fr);
+        if (did_read != len)
+                return backend_fail(FR_DISK_ERR);
+        return 0;
+}
+
+static int      backend_write(uint32_t sector, const uint8_t *buf, unsigned int count)
+{
+        if (disc_spi)
+                return sd_spi_write(disc_lba + sector, buf, count) == 0 ? 0 : backend_fail(FR_DISK_ERR);
+        if (disc_raw) {
+                DRESULT dr = disk_write(disc_pdrv, buf, disc_lba + sector, count);
+
+                return dr == RES_OK ? 0 : backend_fail_dr(dr);
+        }
+
+        unsigned int len = count * SD_DISC_SECTOR_SIZE;
+        unsigned int did_write = 0;
+        FRESULT fr;
+
+        if ((fr = f_lseek(disc_fp, (FSIZE_t)sector * SD_DISC_SECTOR_SIZE)) != FR_OK ||
+            (fr = f_write(disc_fp, buf, len, &did_write)) != FR_OK)
+                return backend_fail(fr);
+        if (did_write != len)
+                return backend_fail(FR_DISK_ERR);
+        return 0;
+}
+
+static int      backend_sync()
+{
+        if (disc_raw) {
+                DRESULT dr = disk_ioctl(disc_pdrv, CTRL_SYNC, NULL);
+
+                return dr == RES_OK ? 0 : backend_fail_dr(dr);
+        }
+
+        FRESULT fr = f_sync(disc_fp);
+
+        return fr == FR_OK ? 0 : backend_fail(fr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sector cache
+
+struct cache_slot {
+        uint32_t sector;
+        uint32_t last_use;
+        bool valid;
+        bool dirty;
+        uint8_t data[SD_DISC_SECTOR_SIZE] __attribute__((aligned(4)));
+};
+
+static struct cache_slot cache[DISC_CACHE_SECTORS];
+static uint32_t cache_clock = 0;
+static unsigned int dirty_count = 0;
+static uint8_t flush_buf[DISC_WRITE_RUN * SD_DISC_SECTOR_SIZE] __attribute__((aligned(4)));
+
+/* Written since the last sync, whether still cached or not */
+static bool unsynced = false;
+static absolute_time_t dirty_since;
+static absolute_time_t last_io;
+/* A failed flush holds off the next timed one for DISC_FLUSH_MS */
+static bool flush_failed = false;
+static absolute_time_t flush_failed_at;
+
+static struct cache_slot *cache_lookup(uint32_t sector)
+{
+        for (int i = 0; i < DISC_CACHE_SECTORS; i++) {
+                if (cache[i].valid && cache[i].sector == sector) {
+                        cache[i].last_use = ++cache_clock;
+                        return &cache[i];
+                }
+        }
+        return NULL;
+}
+
+static int      cache_writeback(struct cache_slot *slot)
+{
+        if (!slot->dirty)
+                return 0;
+        if (backend_write(slot->sector, slot->data, 1) != 0)
+                return -1;
+        slot->dirty = false;
+        dirty_count--;
+        stat_writebacks++;
+        stat_write_runs++;
+        return 0;
+}
+
+static struct cache_slot *cache_find_dirty(uint32_t sector)
+{
+        for (int i = 0; i < DISC_CACHE_SECTORS; i++) {
+                if (cache[i].valid && cache[i].dirty && cache[i].sector == sector)
+                        return &cache[i];
+        }
+        return NULL;
+}
+
+/* Write all dirty sectors back in ascending order, coalescing adjacent
+ * ones into runs of up to DISC_WRITE_RUN sectors.
+ */
+static int      cache_flush_dirty()
+{
+        while (dirty_count > 0) {
+                struct cache_slot *run[DISC_WRITE_RUN];
+                struct cache_slot *first = NULL;
+                unsigned int count = 1;
+
+                for (int i = 0; i < DISC_CACHE_SECTORS; i++) {
+                        if (cache[i].valid && cache[i].dirty &&
+                            (first == NULL || cache[i].sector < first->sector))
+                                first = &cache[i];
+                }
+                if (first == NULL)
+                        break;
+
+                run[0] = first;
+                while (count < DISC_WRITE_RUN &&
+                       (run[count] = cache_find_dirty(first->sector + count)) != NULL)
+                        count++;
+
+                if (count == 1) {
+                        if (cache_writeback(first) != 0)
+                                return -1;
+                        continue;
+                }
+
+                for (unsigned int i = 0; i < count; i++)
+                        memcpy(flush_buf + i * SD_DISC_SECTOR_SIZE, run[i]->data, SD_DISC_SECTOR_SIZE);
+                if (backend_write(first->sector, flush_buf, count) != 0)
+                        return -1;
+                for (unsigned int i = 0; i < count; i++)
+                        run[i]->dirty = false;
+                dirty_count -= count;
+                stat_writebacks += count;
+                stat_write_runs++;
+        }
+        return 0;
+}
+
+/* Claim the least recently used slot for a sector, writing back what was there */
+static struct cache_slot *cache_alloc(uint32_t sector)
+{
+        struct cache_slot *victim = &cache[0];
+
+        for (int i = 0; i < DISC_CACHE_SECTORS; i++) {
+                if (!cache[i].valid) {
+                        victim = &cache[i];
+                        break;
+                }
+                if (cache[i].last_use < victim->last_use)
+                        victim = &cache[i];
+        }
+
+        if (victim->valid && cache_writeback(victim) != 0)
+                return NULL;
+
+        victim->sector = sector;
+        victim->valid = true;
+        victim->dirty = false;
+        victim->last_use = ++cache_clock;
+        return victim;
+}
+
+static void     note_write()
+{
+        if (!unsynced) {
+                unsynced = true;
+                dirty_since = get_absolute_time();
+        }
+}
+
+static void     cache_mark_dirty(struct cache_slot *slot)
+{
+        if (!slot->dirty) {
+                slot->dirty = true;
+                dirty_count++;
+        }
+        note_write();
+}
+
+/* Keep copies of sectors that missed */
+static int      cache_fill(uint32_t sector, const uint8_t *data, unsigned int count)
+{
+        for (unsigned int i = 0; i < count; i++) {
+                struct cache_slot *slot = cache_alloc(sector + i);
+
+                if (slot == NULL)
+                        return -1;
+                memcpy(slot->data, data + i * SD_DISC_SECTOR_SIZE, SD_DISC_SECTOR_SIZE);
+        }
+        return 0;
+}
+
+/* Return the cached copy of a sector, reading it in on a miss */
+static struct cache_slot *cache_get(uint32_t sector)
+{
+        struct cache_slot *slot = cache_lookup(sector);
+
+        if (slot != NULL) {
+                stat_hits++;
+                return slot;
+        }
+
+        stat_misses++;
+        slot = cache_alloc(sector);
+        if (slot == NULL)
+                return NULL;
+        if (backend_read(sector, slot->data, 1) != 0) {
+                slot->valid = false;
+                return NULL;
+        }
+        return slot;
+}
+
+#if DISC_READAHEAD > 0
+////////////////////////////////////////////////////////////////////////////////
+// Read-ahead
+//
+// When a read starts where the previous one ended, a run that misses the
+// cache is fetched together with the sectors after it, in one transfer,
+// into a staging buffer that the following reads are served from.  The
+// fetch is synchronous: the card belongs to core1, and one multi-block
+// command costs little more than the single-sector one it replaces.
+
+static uint8_t ra_buf[DISC_READAHEAD * SD_DISC_SECTOR_SIZE] __attribute__((aligned(4)));
+static uint32_t ra_start;
+static unsigned int ra_count = 0;
+static uint32_t ra_next = UINT32_MAX;   /* Sector a sequential read starts at */
+
+static inline bool ra_covers(uint32_t sector, unsigned int count)
+{
+        return sector >= ra_start && sector + count <= ra_start + ra_count;
+}
+
+static void     ra_fetch(uint32_t sector)
+{
+        unsigned int count = DISC_READAHEAD;
+
+        if (sector >= disc_sectors)
+                return;
+        if (sector + count > disc_sectors)
+                count = disc_sectors - sector;
+
+        ra_count = 0;
+        if (backend_read(sector, ra_buf, count) != 0)
+                return;
+
+        /* The card is behind any dirty cached sectors in the window */
+        for (int i = 0; i < DISC_CACHE_SECTORS; i++) {
+                if (cache[i].valid && cache[i].dirty &&
+                    cache[i].sector >= sector && cache[i].sector < sector + count)
+                        memcpy(ra_buf + (cache[i].sector - sector) * SD_DISC_SECTOR_SIZE,
+                               cache[i].data, SD_DISC_SECTOR_SIZE);
+        }
+        ra_start = sector;
+        ra_count = count;
+        stat_ra_fetched += count;
+}
+
+/* Every write passes through here, so staged data is never stale */
+static void     ra_invalidate(uint32_t sector, unsigned int count)
+{
+        if (sector < ra_start + ra_count && sector + count > ra_start)
+                ra_count = 0;
+}
+#endif
+
+/* Read a run of whole sectors that all missed the cache */
+static int      read_run(uint32_t sector, uint8_t *data, unsigned int count,
+                         bool fill, bool sequential)
+{
+#if DISC_READAHEAD > 0
+        if (sequential && count < DISC_READAHEAD && !ra_covers(sector, count))
+                ra_fetch(sector);
+
+        if (ra_covers(sector, count)) {
+                memcpy(data, ra_buf + (sector - ra_start) * SD_DISC_SECTOR_SIZE,
+                       count * SD_DISC_SECTOR_SIZE);
+                stat_ra_hits += count;
+        } else
+#endif
+        {
+                stat_misses += count;
+                if (backend_read(sector, data, count) != 0)
+                        return -1;
+        }
+
+        return fill ? cache_fill(sector, data, count) : 0;
+}
+
+int             sd_disc_read(uint8_t *data, unsigned int offset, unsigned int len)
+{
+        bool fill = len <= DISC_CACHE_FILL_MAX;
+
+        last_io = get_absolute_time();
+        last_result = FR_OK;
+#if DISC_READAHEAD > 0
+        bool sequential = offset / SD_DISC_SECTOR_SIZE == ra_next;
+
+        ra_next = (offset + len) / SD_DISC_SECTOR_SIZE;
+#else
+        bool sequential = false;
+#endif
+
+        while (len > 0) {
+                uint32_t sector = offset / SD_DISC_SECTOR_SIZE;
+                unsigned int start = offset % SD_DISC_SECTOR_SIZE;
+                unsigned int n = SD_DISC_SECTOR_SIZE - start;
+                struct cache_slot *slot = NULL;
+
+                if (n > len)
+                        n = len;
+
+                if (n == SD_DISC_SECTOR_SIZE && (slot = cache_lookup(sector)) == NULL) {
+                        /* Gather the run of whole sectors that all missed */
+                        unsigned int count = 1;
+
+                        while ((count + 1) * SD_DISC_SECTOR_SIZE <= len &&
+                               cache_lookup(sector + count) == NULL)
+                                count++;
+
+                        if (read_run(sector, data, count, fill, sequential) != 0)
+                                return -1;
+                        n = count * SD_DISC_SECTOR_SIZE;
+                } else {
+                        if (slot != NULL)
+                                stat_hits++;
+                        else if ((slot = cache_get(sector)) == NULL)
+                                return -1;
+                        memcpy(data, slot->data + start, n);
+                }
+
+                data += n;
+                offset += n;
+                len -= n;
+        }
+        return 0;
+}
+
+int             sd_disc_write(uint8_t *data, unsigned int offset, unsigned int len)
+{
+        bool fill = len <= DISC_CACHE_FILL_MAX;
+
+        if (len == 0)
+                return 0;
+        last_io = get_absolute_time();
+        last_result = FR_OK;
+#if DISC_READAHEAD > 0
+        ra_invalidate(offset / SD_DISC_SECTOR_SIZE,
+                      (offset + len - 1) / SD_DISC_SECTOR_SIZE - offset / SD_DISC_SECTOR_SIZE + 1);
+#endif
+
+        while (len > 0) {
+                uint32_t sector = offset / SD_DISC_SECTOR_SIZE;
+                unsigned int start = offset % SD_DISC_SECTOR_SIZE;
+                unsigned int n = SD_DISC_SECTOR_SIZE - start;
+                struct cache_slot *slot;
+
+                if (n > len)
+                        n = len;
+
+                if (n == SD_DISC_SECTOR_SIZE) {
+                        slot = cache_lookup(sector);
+                        if (slot == NULL && !fill) {
+                                /* Big writes go straight through, a run at a time */
+                                unsigned int count = 1;
+
+                                while ((count + 1) * SD_DISC_SECTOR_SIZE <= len &&
+                                       cache_lookup(sector + count) == NULL)
+                                        count++;
+
+                                if (backend_write(sector, data, count) != 0)
+                                        return -1;
+                                note_write();
+                                n = count * SD_DISC_SECTOR_SIZE;
+                                goto next;
+                        }
+                        if (slot == NULL && (slot = cache_alloc(sector)) == NULL)
+                                return -1;
+                } else if ((slot = cache_get(sector)) == NULL) {
+                        return -1;
+                }
+
+                memcpy(slot->data + start, data, n);
+                cache_mark_dirty(slot);
+        next:
+                data += n;
+                offset += n;
+                len -= n;
+        }
+
+        /* Full: write back now, but leave the sync for a quieter moment.
+         * The cache has the data either way, so if this fails it's left
+         * for sd_disc_poll() or a flush to retry, not reported to the Mac.
+         */
+        if (dirty_count >= DISC_DIRTY_MAX)
+                cache_flush_dirty();
+        return 0;
+}
+
+int             sd_disc_flush()
+{
+        if (!unsynced)
+                return 0;
+
+        /* On failure the sectors stay dirty, for a later poll to retry */
+        if (cache_flush_dirty() != 0 || backend_sync() != 0) {
+                flush_failed = true;
+                flush_failed_at = get_absolute_time();
+                return -1;
+        }
+        flush_failed = false;
+        unsynced = false;
+        return 0;
+}
+
+FRESULT         sd_disc_last_result()
+{
+        return last_result;
+}
+
+bool            sd_disc_unsaved()
+{
+        return unsynced;
+}
+
+void            sd_disc_poll()
+{
+        if (!unsynced)
+                return;
+
+        absolute_time_t now = get_absolute_time();
+
+        /* Each try may block on write timeouts, so a failing card isn't
+         * retried on every pass of the emulator loop
+         */
+        if (flush_failed && absolute_time_diff_us(flush_failed_at, now) < DISC_FLUSH_MS * 1000)
+                return;
+        if (absolute_time_diff_us(last_io, now) >= DISC_IDLE_MS * 1000 ||
+            absolute_time_diff_us(dirty_since, now) >= DISC_FLUSH_MS * 1000)
+                sd_disc_flush();
+}
+
+
+#if FF_USE_FASTSEEK
+#if DISC_RAW
+/* A link map of one fragment ([size, n_clusters, first_cluster, 0]) means
+ * the image is contiguous, so sector n of it is card sector disc_lba + n.
+ */
+static void     setup_raw(FIL *fp, const pico_fatfs_spi_config_t *spi)
+{
+        FATFS *fs = fp->obj.fs;
+
+        if (disc_clmt[0] != 4 || FF_MAX_SS != SD_DISC_SECTOR_SIZE)
+                return;
+
+        /* Nothing of ours may be left in FatFs' file buffer */
+        if (f_sync(fp) != FR_OK)
+                return;
+
+        disc_pdrv = fs->pdrv;
+        disc_lba = fs->database + (LBA_t)fs->csize * (disc_clmt[2] - 2);
+        disc_raw = true;
+        printf("sd_disc: contiguous image, raw access from LBA %lu\n", (uint32_t)disc_lba);
+
+#if DISC_SPI_DMA
+        BYTE type;
+
+        if (disk_ioctl(disc_pdrv, MMC_GET_TYPE, &type) == RES_OK &&
+            sd_spi_init(spi->spi_inst, spi->pin_cs, type & CT_BLOCK)) {
+                disc_spi = true;
+                printf("sd_disc: DMA multi-block transfers (card type %02x)\n", type);
+#if DISC_BENCH
+                sd_spi_benchmark(disc_lba, f_size(fp) / SD_DISC_SECTOR_SIZE);
+#endif
+        }
+#endif
+}
+#endif
+
+/* Give the file a cluster link map so f_lseek() doesn't walk the FAT.
+ * If the image is too fragmented for the table, seek the slow way.
+ */
+static void     setup_fastseek(FIL *fp, const pico_fatfs_spi_config_t *spi)
+{
+        fp->cltbl = disc_clmt;
+        disc_clmt[0] = DISC_CLMT_WORDS;
+
+        FRESULT fr = f_lseek(fp, CREATE_LINKMAP);
+
+        if (fr == FR_OK) {
+                printf("sd_disc: fast seek, %lu/%u link map words\n",
+                       disc_clmt[0], DISC_CLMT_WORDS);
+#if DISC_RAW
+                setup_raw(fp, spi);
+#endif
+        } else {
+                fp->cltbl = NULL;
+                if (fr == FR_NOT_ENOUGH_CORE)
+                        printf("sd_disc: no fast seek, image needs %lu link map words (DISC_CLMT_WORDS %u)\n",
+                               disc_clmt[0], DISC_CLMT_WORDS);
+                else
+                        printf("sd_disc: no fast seek (%d)\n", fr);
+        }
+}
+#endif
+
+#if SD_TUNE
+/* The cache file is one line, "<SPI Hz> <clk_peri Hz>"; it's only valid
+ * for the same peripheral clock.
+ */
+static uint32_t tune_load(uint32_t peri_hz)
+{
+        FIL fp;
+        char line[32];
+        unsigned int did_read = 0;
+
+        if (f_open(&fp, SD_TUNE_FILE, FA_READ) != FR_OK)
+                return 0;
+        f_read(&fp, line, sizeof(line) - 1, &did_read);
+        f_close(&fp);
+        line[did_read] = 0;
+
+        char *end;
+        uint32_t hz = strtoul(line, &end, 10);
+
+        return strtoul(end, NULL, 10) == peri_hz ? hz : 0;
+}
+
+static void     tune_save(uint32_t hz, uint32_t peri_hz)
+{
+        FIL fp;
+        char line[32];
+        unsigned int did_write;
+        int len = snprintf(line, sizeof(line), "%lu %lu\n", hz, peri_hz);
+
+        if (f_open(&fp, SD_TUNE_FILE, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+                return;
+        f_write(&fp, line, len, &did_write);
+        f_close(&fp);
+}
+
+/* Card sectors the write check may overwrite, those of a new contiguous
+ * file left open in fp, or 0 if there's no room for one
+ */
+static LBA_t    tune_write_area(FIL *fp)
+{
+#if FF_USE_EXPAND
+        if (f_open(fp, SD_TUNE_WRITE_FILE, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+                return 0;
+        if (FF_MAX_SS == SD_DISC_SECTOR_SIZE &&
+            f_expand(fp, SD_TUNE_SECTORS * SD_DISC_SECTOR_SIZE, 1) == FR_OK)
+                return fp->obj.fs->database + (LBA_t)fp->obj.fs->csize * (fp->obj.sclust - 2);
+        f_close(fp);
+        f_unlink(SD_TUNE_WRITE_FILE);
+#else
+#warning "FF_USE_EXPAND is 0 in ffconf.h: SD clock tuning only checks reads, not writes"
+#endif
+        return 0;
+}
+
+/* The fastest rate that passes reads from the start of the card, which
+ * every card has, and writes to write_lba, or 0
+ */
+static uint32_t tune_rate(spi_inst_t *spi, uint32_t peri_hz, LBA_t write_lba, uint8_t *scratch)
+{
+        uint32_t max_hz = SD_TUNE_MAX_MHZ * 1000 * 1000;
+        uint32_t hz;
+
+        if (max_hz > peri_hz / 2)
+                max_hz = peri_hz / 2;
+
+        /* Reads find a rate, then it's lowered until writes pass too */
+        hz = sd_spi_tune(0, SD_TUNE_SECTORS, max_hz, SD_TUNE_MIN_HZ, SD_TUNE_SAFE_HZ, scratch);
+        while (hz != 0 && !sd_spi_verify_write(write_lba, SD_TUNE_SECTORS, SD_TUNE_SAFE_HZ, scratch)) {
+                printf("sd_disc: SD writes failed at %lu Hz\n", hz);
+                hz = sd_spi_tune(0, SD_TUNE_SECTORS, hz - 1, SD_TUNE_MIN_HZ, SD_TUNE_SAFE_HZ, scratch);
+        }
+        if (hz != 0) {
+                printf("sd_disc: SD clock %lu Hz (clk_peri %lu Hz)\n", hz, peri_hz);
+                tune_save(hz, peri_hz);
+        }
+        return hz;
+}
+#endif
+
+void            sd_disc_tune_clock(const pico_fatfs_spi_config_t *spi, uint8_t *scratch,
+                                   unsigned int scratch_len)
+{
+#if SD_TUNE
+        uint32_t peri_hz = clock_get_hz(clk_peri);
+        uint32_t hz;
+        BYTE type;
+        FIL fp;
+        LBA_t write_lba;
+
+        if (scratch_len < 2 * SD_TUNE_SECTORS * SD_DISC_SECTOR_SIZE ||
+            disk_ioctl(0, MMC_GET_TYPE, &type) != RES_OK ||
+            !sd_spi_init(spi->spi_inst, spi->pin_cs, type & CT_BLOCK))
+                return;
+
+        /* A cached rate passed the write check when it was picked, so
+         * reads are enough to see the card still takes it; that keeps
+         * ordinary boots from writing to the card at all
+         */
+        hz = tune_load(peri_hz);
+        if (hz != 0) {
+                spi_set_baudrate(spi->spi_inst, hz);
+                if (sd_spi_verify(0, SD_TUNE_SECTORS, SD_TUNE_SAFE_HZ, scratch)) {
+                        printf("sd_disc: SD clock %lu Hz (cached)\n", hz);
+                        return;
+                }
+                printf("sd_disc: cached SD clock %lu Hz failed, tuning again\n", hz);
+        }
+
+        /* The disc is written at the rate picked, so that has to be tested too */
+        write_lba = tune_write_area(&fp);
+        if (write_lba == 0) {
+                hz = spi_set_baudrate(spi->spi_inst, spi->clk_fast);
+                printf("sd_disc: nowhere to test SD writes, using %lu Hz\n", hz);
+                return;
+        }
+
+        hz = tune_rate(spi->spi_inst, peri_hz, write_lba, scratch);
+        if (hz == 0) {
+                hz = spi_set_baudrate(spi->spi_inst, spi->clk_fast);
+                printf("sd_disc: SD clock tuning failed, using %lu Hz\n", hz);
+        }
+
+        f_close(&fp);
+        f_unlink(SD_TUNE_WRITE_FILE);
+#endif
+}
+
+static const char *access_path()
+{
+        if (disc_spi)
+                return "DMA multi-block transfers";
+        if (disc_raw)
+                return "raw sector access";
+#if FF_USE_FASTSEEK
+        if (disc_fp->cltbl != NULL)
+                return "FatFs with fast seek";
+#endif
+        return "FatFs without fast seek";
+}
+
+void            sd_disc_open(FIL *fp, const pico_fatfs_spi_config_t *spi)
+{
+        disc_fp = fp;
+        disc_raw = false;
+        disc_spi = false;
+        disc_sectors = f_size(fp) / SD_DISC_SECTOR_SIZE;
+#if DISC_READAHEAD > 0
+        ra_count = 0;
+        ra_next = UINT32_MAX;
+#endif
+        memset(cache, 0, sizeof(cache));
+        dirty_count = 0;
+        unsynced = false;
+        printf("sd_disc: %u byte image, %u sector cache\n",
+               (unsigned int)f_size(fp), DISC_CACHE_SECTORS);
+#if FF_USE_FASTSEEK
+        setup_fastseek(fp, spi);
+#endif
+        printf("sd_disc: using %s\n", access_path());
+}
+
+void            sd_disc_print_stats()
+{
+        uint32_t hits = stat_hits;
+        uint32_t misses = stat_misses;
+        uint32_t total = hits + misses;
+
+        printf("sd_disc: %lu hits %lu misses (%lu%% hit) %lu writebacks in %lu runs\n",
+               hits, misses, total ? hits * 100 / total : 0, stat_writebacks, stat_write_runs);
+#if DISC_READAHEAD > 0
+        uint32_t fetched = stat_ra_fetched;
+        uint32_t ra_hits = stat_ra_hits;
+
+        printf("sd_disc: read-ahead %u sectors, %lu fetched %lu used (%lu%%)\n",
+               DISC_READAHEAD, fetched, ra_hits, fetched ? ra_hits * 100 / fetched : 0);
+#endif
+}
@@ -0,0 +1,430 @@
+/* SD card multi-block SPI transfers
+ *
+ * pico_fatfs moves every byte with the CPU.  For a contiguous disc image
+ * sd_disc reads and writes runs of sectors itself, using CMD18/CMD25 and
+ * DMA for the 512 byte data blocks so they go at the SPI line rate.
+ * Card initialisation, clocking and everything else is left to
+ * pico_fatfs; this only runs on the core that owns the card (core1).
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "sd_spi.h"
+
+#define SD_BLOCK        512
+
+#define CMD12           12      /* STOP_TRANSMISSION */
+#define CMD17           17      /* READ_SINGLE_BLOCK */
+#define CMD18           18      /* READ_MULTIPLE_BLOCK */
+#define CMD24           24      /* WRITE_BLOCK */
+#define CMD25           25      /* WRITE_MULTIPLE_BLOCK */
+
+#define TOKEN_START     0xfe    /* Single block, and every read block */
+#define TOKEN_MULTI     0xfc    /* CMD25 data block */
+#define TOKEN_STOP      0xfd    /* End of CMD25 */
+
+#define READ_TIMEOUT_US         100000
+#define WRITE_TIMEOUT_US        500000
+
+static spi_inst_t *sd_spi;
+static uint sd_cs;
+static bool sd_block_addressed;
+static int dma_tx = -1;
+static int dma_rx = -1;
+
+static const uint8_t dummy_tx = 0xff;
+static uint8_t dummy_rx;
+
+static bool check_crc = false;
+
+static inline uint8_t xchg(uint8_t b)
+{
+        uint8_t r;
+        spi_write_read_blocking(sd_spi, &b, &r, 1);
+        return r;
+}
+
+static bool     wait_ready(uint32_t timeout_us)
+{
+        uint32_t start = time_us_32();
+
+        do {
+                if (xchg(0xff) == 0xff)
+                        return true;
+        } while (time_us_32() - start < timeout_us);
+        return false;
+}
+
+static void     deselect()
+{
+        gpio_put(sd_cs, 1);
+        xchg(0xff);     /* Card releases MISO on the next clock */
+}
+
+static bool     select()
+{
+        gpio_put(sd_cs, 0);
+        xchg(0xff);
+        if (wait_ready(WRITE_TIMEOUT_US))
+                return true;
+        deselect();
+        return false;
+}
+
+/* Returns R1; the CRC is only checked for CMD0/CMD8, which FatFs sends */
+static uint8_t  send_cmd(uint8_t cmd, uint32_t arg)
+{
+        uint8_t frame[6] = { 0x40 | cmd, arg >> 24, arg >> 16, arg >> 8, arg, 0x01 };
+        uint8_t r1 = 0xff;
+
+        spi_write_blocking(sd_spi, frame, sizeof(frame));
+        if (cmd == CMD12)
+                xchg(0xff);     /* Stuff byte */
+        for (int n = 0; n < 10; n++) {
+                r1 = xchg(0xff);
+                if (!(r1 & 0x80))
+                        break;
+        }
+        return r1;
+}
+
+/* Clock len bytes each way.  A NULL tx sends 0xff, a NULL rx discards. */
+static void     dma_transfer(uint8_t *rx, const uint8_t *tx, unsigned int len)
+{
+        volatile void *dr = &spi_get_hw(sd_spi)->dr;
+        dma_channel_config c;
+
+        c = dma_channel_get_default_config(dma_tx);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+        channel_config_set_dreq(&c, spi_get_dreq(sd_spi, true));
+        channel_config_set_read_increment(&c, tx != NULL);
+        channel_config_set_write_increment(&c, false);
+        dma_channel_configure(dma_tx, &c, dr, tx ? tx : &dummy_tx, len, false);
+
+        c = dma_channel_get_default_config(dma_rx);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+        channel_config_set_dreq(&c, spi_get_dreq(sd_spi, false));
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, rx != NULL);
+        dma_channel_configure(dma_rx, &c, rx ? rx : &dummy_rx, dr, len, false);
+
+        dma_start_channel_mask((1u << dma_tx) | (1u << dma_rx));
+        dma_channel_wait_for_finish_blocking(dma_rx);
+}
+
+/* CRC-16/XMODEM, as SD uses for data blocks */
+static uint16_t crc16(const uint8_t *p, unsigned int len)
+{
+        uint16_t crc = 0;
+
+        while (len--) {
+                crc ^= *p++ << 8;
+                for (int i = 0; i < 8; i++)
+                        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        return crc;
+}
+
+static bool     rx_block(uint8_t *buf)
+{
+        uint32_t start = time_us_32();
+        uint8_t token;
+
+        while ((token = xchg(0xff)) == 0xff) {
+                if (time_us_32() - start >= READ_TIMEOUT_US)
+                        return false;
+        }
+        if (token != TOKEN_START)
+                return false;
+
+        dma_transfer(buf, NULL, SD_BLOCK);
+
+        /* The card always sends a CRC16 for data, whether or not it checks ours */
+        uint16_t crc = xchg(0xff) << 8;
+        crc |= xchg(0xff);
+        return !check_crc || crc == crc16(buf, SD_BLOCK);
+}
+
+static bool     tx_block(const uint8_t *buf, uint8_t token)
+{
+        if (!wait_ready(WRITE_TIMEOUT_US))
+                return false;
+
+        xchg(token);
+        if (token == TOKEN_STOP)
+                return true;
+
+        dma_transfer(NULL, buf, SD_BLOCK);
+        xchg(0xff);     /* CRC16, ignored by the card in SPI mode */
+        xchg(0xff);
+        return (xchg(0xff) & 0x1f) == 0x05;     /* Data accepted */
+}
+
+bool            sd_spi_init(spi_inst_t *spi, uint cs_pin, bool block_addressed)
+{
+        sd_spi = spi;
+        sd_cs = cs_pin;
+        sd_block_addressed = block_addressed;
+
+        if (dma_tx < 0) {
+                dma_tx = dma_claim_unused_channel(false);
+                dma_rx = dma_claim_unused_channel(false);
+        }
+        return dma_tx >= 0 && dma_rx >= 0;
+}
+
+int             sd_spi_read(uint32_t lba, uint8_t *buf, unsigned int count)
+{
+        uint32_t addr = sd_block_addressed ? lba : lba * SD_BLOCK;
+        int ret = -1;
+
+        if (!select())
+                return -1;
+
+        if (count == 1) {
+                if (send_cmd(CMD17, addr) == 0 && rx_block(buf))
+                        ret = 0;
+        } else if (send_cmd(CMD18, addr) == 0) {
+                unsigned int i;
+
+                for (i = 0; i < count && rx_block(buf + i * SD_BLOCK); i++)
+                        ;
+                send_cmd(CMD12, 0);
+                if (i == count)
+                        ret = 0;
+        }
+
+        deselect();
+        return ret;
+}
+
+int             sd_spi_write(uint32_t lba, const uint8_t *buf, unsigned int count)
+{
+        uint32_t addr = sd_block_addressed ? lba : lba * SD_BLOCK;
+        int ret = -1;
+
+        if (!select())
+                return -1;
+
+        if (count == 1) {
+                if (send_cmd(CMD24, addr) == 0 && tx_block(buf, TOKEN_START))
+                        ret = 0;
+        } else if (send_cmd(CMD25, addr) == 0) {
+                unsigned int i;
+
+                for (i = 0; i < count && tx_block(buf + i * SD_BLOCK, TOKEN_MULTI); i++)
+                        ;
+                if (tx_block(NULL, TOKEN_STOP) && i == count)
+                        ret = 0;
+        }
+
+        /* Let the card finish programming before anyone else talks to it */
+        if (!wait_ready(WRITE_TIMEOUT_US))
+                ret = -1;
+        deselect();
+        return ret;
+}
+
+void            sd_spi_set_crc_check(bool enable)
+{
+        check_crc = enable;
+}
+
+#define TUNE_PASSES     4
+#define TUNE_RUN        8       /* Sectors per multi-block read */
+
+/* Several passes of multi-block and single-block reads, CRC-checked and
+ * compared against ref.
+ */
+static bool     tune_test(uint32_t lba, unsigned int sectors, const uint8_t *ref, uint8_t *buf)
+{
+        bool ok = true;
+
+        check_crc = true;
+        for (int pass = 0; ok && pass < TUNE_PASSES; pass++) {
+                unsigned int run = (pass & 1) ? 1 : TUNE_RUN;
+
+                for (unsigned int s = 0; ok && s < sectors; s += run) {
+                        unsigned int n = (sectors - s < run) ? sectors - s : run;
+
+                        ok = sd_spi_read(lba + s, buf + s * SD_BLOCK, n) == 0;
+                }
+                ok = ok && memcmp(buf, ref, sectors * SD_BLOCK) == 0;
+        }
+        check_crc = false;
+        return ok;
+}
+
+static bool     tune_reference(uint32_t lba, unsigned int sectors, uint32_t safe_hz, uint8_t *ref)
+{
+        uint32_t hz = spi_get_baudrate(sd_spi);
+        bool ok;
+
+        spi_set_baudrate(sd_spi, safe_hz);
+        check_crc = true;
+        ok = sd_spi_read(lba, ref, sectors) == 0;
+        check_crc = false;
+        spi_set_baudrate(sd_spi, hz);
+        return ok;
+}
+
+bool            sd_spi_verify(uint32_t lba, unsigned int sectors, uint32_t safe_hz, uint8_t *buf)
+{
+        uint8_t *ref = buf + sectors * SD_BLOCK;
+
+        return tune_reference(lba, sectors, safe_hz, ref) && tune_test(lba, sectors, ref, buf);
+}
+
+bool            sd_spi_verify_write(uint32_t lba, unsigned int sectors, uint32_t safe_hz, uint8_t *buf)
+{
+        uint8_t *back = buf + sectors * SD_BLOCK;
+        uint32_t seed = lba ^ spi_get_baudrate(sd_spi);
+        bool ok = true;
+
+        /* Multi-block writes, then single-block, of a pattern for this rate */
+        for (int pass = 0; ok && pass < 2; pass++) {
+                unsigned int run = pass ? 1 : TUNE_RUN;
+
+                for (unsigned int i = 0; i < sectors * SD_BLOCK; i++) {
+                        seed = seed * 1664525 + 1013904223;
+                        buf[i] = seed >> 24;
+                }
+                for (unsigned int s = 0; ok && s < sectors; s += run) {
+                        unsigned int n = (sectors - s < run) ? sectors - s : run;
+
+                        ok = sd_spi_write(lba + s, buf + s * SD_BLOCK, n) == 0;
+                }
+                ok = ok && tune_reference(lba, sectors, safe_hz, back) &&
+                        memcmp(buf, back, sectors * SD_BLOCK) == 0;
+        }
+
+        if (!ok) {
+                /* Let a garbled write finish before going on at safe_hz */
+                uint32_t hz = spi_get_baudrate(sd_spi);
+
+                spi_set_baudrate(sd_spi, safe_hz);
+                if (select())
+                        deselect();
+                spi_set_baudrate(sd_spi, hz);
+        }
+        return ok;
+}
+
+uint32_t        sd_spi_tune(uint32_t lba, unsigned int sectors, uint32_t max_hz,
+                            uint32_t min_hz, uint32_t safe_hz, uint8_t *buf)
+{
+        uint8_t *ref = buf + sectors * SD_BLOCK;
+        uint32_t hz = max_hz;
+
+        if (!tune_reference(lba, sectors, safe_hz, ref)) {
+                spi_set_baudrate(sd_spi, safe_hz);
+                return 0;
+        }
+
+        /* Step down through the rates the SPI divider can actually make */
+        while (hz >= min_hz) {
+                uint32_t actual = spi_set_baudrate(sd_spi, hz);
+
+                if (actual < min_hz)
+                        break;
+                if (tune_test(lba, sectors, ref, buf)) {
+                        printf("sd_spi: %lu Hz passed\n", actual);
+                        return actual;
+                }
+                printf("sd_spi: %lu Hz failed\n", actual);
+                hz = actual - 1;
+
+                /* A garbled exchange can leave a CMD18 running; stop it */
+                spi_set_baudrate(sd_spi, safe_hz);
+                if (select()) {
+                        send_cmd(CMD12, 0);
+                        deselect();
+                }
+        }
+
+        spi_set_baudrate(sd_spi, safe_hz);
+        return 0;
+}
+
+#if DISC_BENCH
+#define BENCH_BYTES     (256 * 1024)
+
+static uint8_t bench_buf[4096] __attribute__((aligned(4)));
+
+static void     bench_pattern(const char *name, uint32_t lba, uint32_t sectors,
+                              unsigned int count, bool random)
+{
+        uint32_t seed = 12345;
+        uint32_t read_us = 0;
+        uint32_t write_us = 0;
+        unsigned int ops = BENCH_BYTES / (count * SD_BLOCK);
+        uint32_t pos = 0;
+
+        for (unsigned int i = 0; i < ops; i++) {
+                uint32_t start;
+
+                if (random) {
+                        seed = seed * 1664525 + 1013904223;
+                        pos = (seed >> 8) % (sectors - count + 1);
+                } else if (pos + count > sectors) {
+                        pos = 0;
+                }
+
+                start = time_us_32();
+                if (sd_spi_read(lba + pos, bench_buf, count) != 0)
+                        goto fail;
+                read_us += time_us_32() - start;
+
+                start = time_us_32();
+                if (sd_spi_write(lba + pos, bench_buf, count) != 0)
+                        goto fail;
+                write_us += time_us_32() - start;
+
+                if (!random)
+                        pos += count;
+        }
+
+        /* Bytes per us is MB/s */
+        printf("sd_spi: %-10s read %lu.%02lu MB/s, write %lu.%02lu MB/s\n", name,
+               BENCH_BYTES / read_us, BENCH_BYTES * 100 / read_us % 100,
+               BENCH_BYTES / write_us, BENCH_BYTES * 100 / write_us % 100);
+        return;
+fail:
+        printf("sd_spi: %s failed\n", name);
+}
+
+void            sd_spi_benchmark(uint32_t lba, uint32_t sectors)
+{
+        if (sectors < sizeof(bench_buf) / SD_BLOCK)
+                return;
+
+        printf("sd_spi: benchmark, %lu Hz SPI\n", (uint32_t)spi_get_baudrate(sd_spi));
+        bench_pattern("seq 512B", lba, sectors, 1, false);
+        bench_pattern("seq 4KB", lba, sectors, 8, false);
+        bench_pattern("rand 512B", lba, sectors, 1, true);
+        bench_pattern("rand 4KB", lba, sectors, 8, true);
+}
+#endif
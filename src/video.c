@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdbool.h>
 
 #include "dvi.h"
 #include "dvi_serialiser.h"
@@ -10,6 +11,10 @@
 #include "hardware/vreg.h"
 #include "hardware/irq.h"
 #include "hardware/clocks.h"
+#include "hardware/sync.h"
+#include "hardware/structs/systick.h"
+#include "hardware/dma.h"
+#include "video.h"
 
 #define VIDEO_FB_HRES           512
 #define VIDEO_FB_VRES           342
@@ -24,8 +29,72 @@
 #define DVI_TIMING dvi_timing_640x480p_60hz
 #define VREG_VSEL VREG_VOLTAGE_1_20
 
+/* TMDS buffers hold one word (two symbols) per pair of pixels */
+#define LINE_WORDS (FRAME_WIDTH / 2)
+#define BORDER_WORDS (HORIZONTAL_OFFSET * 4)
+#define ACTIVE_WORDS (VIDEO_FB_HRES / 2)
+
+#ifndef VIDEO_LINE_CACHE
+#define VIDEO_LINE_CACHE 0
+#endif
+
+#ifndef VIDEO_PROFILE
+#define VIDEO_PROFILE 0
+#endif
+
+#ifndef VIDEO_LATCH
+#define VIDEO_LATCH 0
+#endif
+
+#ifndef VIDEO_SCRATCH
+#define VIDEO_SCRATCH 0
+#endif
+
+#ifndef VIDEO_OVERLAY
+#define VIDEO_OVERLAY 0
+#endif
+
+/* Hot path placement.  With VIDEO_SCRATCH the scanline code goes to scratch Y
+ * and its tables to scratch X, so core0 never competes with core1 for the
+ * striped SRAM banks that hold the emulator.  The helpers below are forced
+ * inline into scanline_callback(), since an out of line copy would land in
+ * flash; cmake/check_scratch.cmake fails the build if one is left over.
+ *
+ * Some of what scan-out touches stays in main SRAM: the line cache, if
+ * enabled (about 8.7KB with 8 slots), is bigger than a scratch bank, and
+ * dvi0 (about 1KB, mostly the DMA control blocks, which the DMA reads
+ * anyway) doesn't fit in what core1's stack and libdvi leave of scratch X.
+ * table[] is only used at init.
+ *
+ * Nor is all of the code in scratch: the queue_remove_blocking() and
+ * queue_add_blocking() calls on libdvi's TMDS queues go to pico_util, which
+ * runs from flash.  check_scratch.cmake only checks what video.c defines.
+ */
+#if VIDEO_SCRATCH
+#define __video_func(group) __scratch_y(group)
+#define __video_data(group) __scratch_x(group)
+#else
+#define __video_func(group) __not_in_flash(group)
+#define __video_data(group)
+#endif
+
 uint8_t* fb = NULL;
 
+#if VIDEO_LATCH
+/* Snapshot of the framebuffer taken at emulated vsync, scanned out instead of
+ * live RAM so a frame never shows two emulated frames.  Scan-out reads lines
+ * 1 to VIDEO_FB_VRES of the framebuffer, hence the extra line.
+ */
+#define LATCH_BYTES ((VIDEO_FB_VRES + 1) * STRIDE)
+/* Lines of margin the copy needs before scan-out reaches the picture */
+#define LATCH_MARGIN 8
+
+static uint8_t __attribute__((aligned(4))) latched_fb[LATCH_BYTES];
+static volatile bool fb_latched = false;
+static int latch_dma_chan;
+static uint32_t latch_skipped = 0;
+#endif
+
 struct dvi_inst dvi0;
 
 
@@ -64,36 +133,446 @@ unsigned char table[] = {
         0x1f ^ 0xFF, 0x9f ^ 0xFF, 0x5f ^ 0xFF, 0xdf ^ 0xFF, 0x3f ^ 0xFF, 0xbf ^ 0xFF, 0x7f ^ 0xFF, 0xff ^ 0xFF,
 };
 
-static inline void prepare_scanline(uint y) {
-	static uint8_t scanbuf[FRAME_WIDTH / 8];
-	
-    memset(scanbuf, 0x00, 80);
+#if VIDEO_LINE_CACHE
+/* Cache of encoded Mac lines, keyed by line content.  A cache indexed by line
+ * number would need 342 encoded lines (~430KB), so instead lines are hashed
+ * and each slot keeps a shadow copy of the source bytes it was encoded from.
+ * Repeated content (desktop pattern, window interiors, unchanged lines from
+ * the previous frame) is then replayed with a copy instead of re-encoded.
+ */
+#if (VIDEO_LINE_CACHE & (VIDEO_LINE_CACHE - 1)) != 0
+#error "VIDEO_LINE_CACHE must be a power of two"
+#endif
+
+struct line_cache_slot {
+	bool valid;
+	uint32_t src[STRIDE / 4];
+	uint32_t tmds[ACTIVE_WORDS];
+};
+
+static struct line_cache_slot line_cache[VIDEO_LINE_CACHE];
+static uint32_t line_cache_hits = 0;
+static uint32_t line_cache_misses = 0;
+
+/* Copy the line to snap and hash the copy.  The emulator on core1 may be
+ * drawing into the line, so everything after this works from snap: a slot
+ * must never hold symbols encoded from bytes other than the ones it keeps.
+ */
+static __force_inline struct line_cache_slot *line_cache_slot(const uint8_t *line, uint32_t *snap)
+{
+	const uint32_t *src = (const uint32_t *)line;
+	uint32_t h = 0;
+
+	for(int i = 0; i < STRIDE / 4; i++)
+	{
+		snap[i] = src[i];
+		h = (h ^ snap[i]) * 0x01000193;
+	}
+
+	return &line_cache[(h >> 24) & (VIDEO_LINE_CACHE - 1)];
+}
+
+static __force_inline bool line_cache_match(const struct line_cache_slot *slot, const uint32_t *src)
+{
+	if(!slot->valid)
+		return false;
+
+	for(int i = 0; i < STRIDE / 4; i++)
+		if(slot->src[i] != src[i])
+			return false;
+
+	return true;
+}
+#endif
+
+#if VIDEO_PROFILE
+/* Cycles spent filling each TMDS buffer, counted with core0's SysTick */
+struct line_profile {
+	uint32_t lines;
+	uint64_t cycles;
+	uint32_t max;
+};
+
+static struct line_profile profile_blank;
+static struct line_profile profile_active;
+
+/* Per line work, from getting a free TMDS buffer to queueing it.  Time
+ * blocked waiting for the free buffer is accounted separately as stall.
+ * Histogram buckets are a power of two cycles wide, between a sixteenth and
+ * an eighth of a line period, the last one catches everything above.
+ */
+#define PROFILE_BUCKETS 16
+
+struct callback_profile {
+	uint32_t hist[PROFILE_BUCKETS];
+	uint32_t worst;
+	uint worst_y;
+	uint32_t late;          //Callback took longer than a line period
+	uint32_t underruns;     //Valid queue had run dry when the line was queued
+	uint64_t stall;         //Cycles blocked on q_tmds_free
+};
+
+static struct callback_profile profile_callback;
+static uint32_t line_period_cycles;
+static uint profile_bucket_shift;
+
+static __force_inline void profile_line(struct line_profile *p, uint32_t start)
+{
+	uint32_t cycles = (start - systick_hw->cvr) & 0x00FFFFFF;
+
+	p->lines++;
+	p->cycles += cycles;
+	if(cycles > p->max)
+		p->max = cycles;
+}
+#endif
+
+/* Black border, encoded once at init.  It is spliced into both sides of
+ * active lines, and blank lines are made of repeated copies of it.
+ */
+static uint32_t __video_data("blank_border") blank_border[BORDER_WORDS];
+
+/* TMDS symbols for every Mac byte, four words (eight pixels) per entry, built
+ * at init by running table[] and tmds_encode_1bpp() over all 256 values.
+ * The 1bpp encoder is a stateless per-pixel-pair lookup, so the symbols for
+ * a byte don't depend on where it sits in the line.
+ *
+ * The 4KB table doesn't fit in a scratch bank, so VIDEO_SCRATCH builds use
+ * one entry of two words (four pixels) per Mac nibble and two lookups a byte.
+ */
+#if VIDEO_SCRATCH
+static uint32_t __video_data("mac_tmds_lut") mac_tmds_lut[16 * 2];
+#else
+static uint32_t mac_tmds_lut[256 * 4];
+#endif
+
+/* Reference two stage encode: bit reverse/invert into scanbuf, then encode.
+ * Not used for scan-out, tests/test_encode.c checks the fused path against it.
+ */
+static inline void encode_line_table(const uint8_t *line, uint32_t *tmdsbuf)
+{
+	static uint8_t scanbuf[STRIDE];
+
+	for(int x = 0; x < STRIDE; x++)
+		scanbuf[x] = table[line[x]];
+
+	tmds_encode_1bpp((const uint32_t*)scanbuf, tmdsbuf, VIDEO_FB_HRES);
+}
+
+/* Encode the 512 Mac pixels of a line, leaving the borders alone.  Fused
+ * straight from the Mac framebuffer, one lookup per byte.
+ */
+static __force_inline void encode_line_lut(const uint8_t *line, uint32_t *tmdsbuf)
+{
+	const uint32_t *src = (const uint32_t *)line;
+
+	for(int x = 0; x < STRIDE / 4; x++)
+	{
+		uint32_t w = src[x];
+
+		for(int b = 0; b < 4; b++)
+		{
+#if VIDEO_SCRATCH
+			const uint32_t *hi = &mac_tmds_lut[((w >> 4) & 0xF) * 2];
+			const uint32_t *lo = &mac_tmds_lut[(w & 0xF) * 2];
+
+			tmdsbuf[0] = hi[0];
+			tmdsbuf[1] = hi[1];
+			tmdsbuf[2] = lo[0];
+			tmdsbuf[3] = lo[1];
+#else
+			const uint32_t *e = &mac_tmds_lut[(w & 0xFF) * 4];
+
+			tmdsbuf[0] = e[0];
+			tmdsbuf[1] = e[1];
+			tmdsbuf[2] = e[2];
+			tmdsbuf[3] = e[3];
+#endif
+			tmdsbuf += 4;
+			w >>= 8;
+		}
+	}
+}
+
+#if VIDEO_OVERLAY
+#include "font_8x8.h"
+
+/* One line of status text, drawn white on black in the blank area above the
+ * Mac picture.  Updated from core0 outside the interrupt; a torn update only
+ * shows for a frame.
+ */
+#define OVERLAY_LINE 8
+#define OVERLAY_COLS (FRAME_WIDTH / FONT_CHAR_WIDTH)
+
+static char overlay_text[OVERLAY_COLS + 1];
+
+static __force_inline bool is_overlay_line(uint y)
+{
+	return overlay_text[0] != 0 && y >= OVERLAY_LINE && y < OVERLAY_LINE + FONT_CHAR_HEIGHT;
+}
+
+static __force_inline void fill_overlay_line(uint row, uint32_t *tmdsbuf)
+{
+	static uint32_t scanbuf[FRAME_WIDTH / 32];
+	uint8_t *pixels = (uint8_t *)scanbuf;
+	bool end = false;
+
+	//The font is stored leftmost pixel in bit 0, as the encoder wants it
+	for(int x = 0; x < OVERLAY_COLS; x++)
+	{
+		char c = overlay_text[x];
 
-    if(fb != NULL && y > FIRST_LINE && y < LAST_LINE)
-    {
-            uint32_t offset = ((y - FIRST_LINE) * STRIDE);
+		if(c == 0)
+			end = true;
 
-            for(int x = 0; x < STRIDE; x++)
-                    scanbuf[x + 8] = table[fb[offset + x]];
-    }
+		if(end || c < FONT_FIRST_ASCII || c >= FONT_FIRST_ASCII + FONT_N_CHARS)
+			pixels[x] = 0;
+		else
+			pixels[x] = font_8x8[(c - FONT_FIRST_ASCII) + row * FONT_N_CHARS];
+	}
+
+	tmds_encode_1bpp(scanbuf, tmdsbuf, FRAME_WIDTH);
+}
+#endif
+
+static void init_mac_tmds_lut()
+{
+	uint32_t pixels[256 / 4];
+
+#if VIDEO_SCRATCH
+	uint32_t symbols[16 * 4];
+
+	//Bytes with only the high nibble set, of which the first four pixels
+	//(two words) are the symbols for that nibble
+	for(int i = 0; i < 16; i++)
+		((uint8_t *)pixels)[i] = table[i << 4];
+
+	tmds_encode_1bpp(pixels, symbols, 16 * 8);
+
+	for(int i = 0; i < 16; i++)
+	{
+		mac_tmds_lut[i * 2] = symbols[i * 4];
+		mac_tmds_lut[i * 2 + 1] = symbols[i * 4 + 1];
+	}
+#else
+	for(int i = 0; i < 256; i++)
+		((uint8_t *)pixels)[i] = table[i];
+
+	tmds_encode_1bpp(pixels, mac_tmds_lut, 256 * 8);
+#endif
+}
+
+static __force_inline void fill_active_line(const uint8_t *line, uint32_t *tmdsbuf)
+{
+	uint32_t *active = tmdsbuf + BORDER_WORDS;
+
+	memcpy(tmdsbuf, blank_border, sizeof(blank_border));
+	memcpy(active + ACTIVE_WORDS, blank_border, sizeof(blank_border));
+
+#if VIDEO_LINE_CACHE
+	uint32_t snap[STRIDE / 4];
+	struct line_cache_slot *slot = line_cache_slot(line, snap);
+
+	if(line_cache_match(slot, snap))
+	{
+		memcpy(active, slot->tmds, sizeof(slot->tmds));
+		line_cache_hits++;
+	}
+	else
+	{
+		encode_line_lut((const uint8_t *)snap, active);
+		memcpy(slot->src, snap, STRIDE);
+		memcpy(slot->tmds, active, sizeof(slot->tmds));
+		slot->valid = true;
+		line_cache_misses++;
+	}
+#else
+	encode_line_lut(line, active);
+#endif
+}
+
+static __force_inline void prepare_scanline(uint y) {
+#if VIDEO_PROFILE
+	uint32_t entry = systick_hw->cvr;
+#endif
+	const uint8_t *line = NULL;
+
+	const uint8_t *src_fb = fb;
+#if VIDEO_LATCH
+	if(fb_latched)
+		src_fb = latched_fb;
+#endif
+
+	if(src_fb != NULL && y > FIRST_LINE && y < LAST_LINE)
+		line = src_fb + ((y - FIRST_LINE) * STRIDE);
 
 	uint32_t* tmdsbuf;
 	queue_remove_blocking(&dvi0.q_tmds_free, &tmdsbuf);
-	tmds_encode_1bpp((const uint32_t*)scanbuf, tmdsbuf, FRAME_WIDTH);
+
+#if VIDEO_PROFILE
+	uint32_t start = systick_hw->cvr;
+	profile_callback.stall += (entry - start) & 0x00FFFFFF;
+#endif
+
+#if VIDEO_OVERLAY
+	if(line == NULL && is_overlay_line(y))
+	{
+		fill_overlay_line(y - OVERLAY_LINE, tmdsbuf);
+	}
+	else
+#endif
+	if(line == NULL)
+	{
+		for(int x = 0; x < LINE_WORDS; x += BORDER_WORDS)
+			memcpy(tmdsbuf + x, blank_border, sizeof(blank_border));
+#if VIDEO_PROFILE
+		profile_line(&profile_blank, start);
+#endif
+	}
+	else
+	{
+		fill_active_line(line, tmdsbuf);
+#if VIDEO_PROFILE
+		profile_line(&profile_active, start);
+#endif
+	}
+
+#if VIDEO_PROFILE
+	if(queue_is_empty(&dvi0.q_tmds_valid))
+		profile_callback.underruns++;
+#endif
 	queue_add_blocking(&dvi0.q_tmds_valid, &tmdsbuf);
+
+#if VIDEO_PROFILE
+	uint32_t cycles = (start - systick_hw->cvr) & 0x00FFFFFF;
+	uint bucket = cycles >> profile_bucket_shift;
+
+	profile_callback.hist[MIN(bucket, PROFILE_BUCKETS - 1)]++;
+	if(cycles > line_period_cycles)
+		profile_callback.late++;
+	if(cycles > profile_callback.worst)
+	{
+		profile_callback.worst = cycles;
+		profile_callback.worst_y = y;
+	}
+#endif
 }
 
-void __not_in_flash("scanline_callback")scanline_callback() {
-	static uint y = 0;
+/* Vertical blank of the Mac picture, published to core1 for emulated vsync */
+static volatile uint32_t vblank_count = 0;
+static volatile uint32_t vblank_time = 0;
+
+/* Next line to be prepared */
+static volatile uint scan_y = 0;
+
+void __video_func("scanline_callback")scanline_callback() {
+	uint y = scan_y;
 	prepare_scanline(y);
-	y = (y + 1) % FRAME_HEIGHT;
+
+	if(y == LAST_LINE)
+	{
+		vblank_time = time_us_32();
+		__dmb();
+		vblank_count++;
+	}
+
+	scan_y = (y + 1) % FRAME_HEIGHT;
+}
+
+uint32_t video_get_vblank(uint32_t *time_us)
+{
+	uint32_t count;
+
+	do
+	{
+		count = vblank_count;
+		__dmb();
+		*time_us = vblank_time;
+		__dmb();
+	} while(count != vblank_count);
+
+	return count;
 }
 
 void set_framebuffer(uint8_t *framebuffer)
 {
+#if VIDEO_LATCH
+    fb_latched = false;
+#endif
     fb = framebuffer;
 }
 
+#if VIDEO_OVERLAY
+void video_set_overlay(const char *text)
+{
+	strncpy(overlay_text, text, OVERLAY_COLS);
+}
+#endif
+
+#if VIDEO_LATCH
+void video_latch_framebuffer()
+{
+	uint y = scan_y;
+
+	//Only copy while scan-out is clear of the picture, otherwise keep
+	//showing the previous snapshot for one more frame
+	if(fb == NULL || (y > FIRST_LINE - LATCH_MARGIN && y < LAST_LINE))
+	{
+		latch_skipped++;
+		return;
+	}
+
+	dma_channel_set_read_addr(latch_dma_chan, fb, false);
+	dma_channel_set_write_addr(latch_dma_chan, latched_fb, true);
+
+	//Wait so the emulator can't draw into lines not yet copied
+	dma_channel_wait_for_finish_blocking(latch_dma_chan);
+	fb_latched = true;
+}
+#endif
+
+#if VIDEO_PROFILE
+void video_print_stats()
+{
+	struct line_profile blank, active;
+	struct callback_profile cb;
+
+	uint32_t irq = save_and_disable_interrupts();
+	blank = profile_blank;
+	active = profile_active;
+	cb = profile_callback;
+	memset(&profile_blank, 0, sizeof(profile_blank));
+	memset(&profile_active, 0, sizeof(profile_active));
+	memset(&profile_callback, 0, sizeof(profile_callback));
+#if VIDEO_LINE_CACHE
+	uint32_t hits = line_cache_hits;
+	uint32_t misses = line_cache_misses;
+	line_cache_hits = 0;
+	line_cache_misses = 0;
+#endif
+	restore_interrupts(irq);
+
+	uint32_t lines = blank.lines + active.lines;
+
+	printf("video: blank %lu cyc/line (max %lu), active %lu cyc/line (max %lu), line period %lu cyc\n",
+		blank.lines ? (uint32_t)(blank.cycles / blank.lines) : 0, blank.max,
+		active.lines ? (uint32_t)(active.cycles / active.lines) : 0, active.max,
+		line_period_cycles);
+	printf("video: worst %lu cyc at line %u, %lu late, %lu underruns, stall %lu cyc/line\n",
+		cb.worst, cb.worst_y, cb.late, cb.underruns,
+		lines ? (uint32_t)(cb.stall / lines) : 0);
+
+	printf("video: histogram (%u cyc buckets):", 1u << profile_bucket_shift);
+	for(int i = 0; i < PROFILE_BUCKETS; i++)
+		printf(" %lu", cb.hist[i]);
+	printf("\n");
+
+#if VIDEO_LINE_CACHE
+	printf("video: line cache %lu hits, %lu misses\n", hits, misses);
+#endif
+}
+#endif
+
 void video_init()
 {
     //Set overclock
@@ -109,6 +588,34 @@ void video_init()
 
     dvi_register_irqs_this_core(&dvi0, DMA_IRQ_0);
 
+    //Pre-encode the border, reused for blanking
+    static const uint32_t black[HORIZONTAL_OFFSET / 4] = { 0 };
+    tmds_encode_1bpp(black, blank_border, HORIZONTAL_OFFSET * 8);
+
+    init_mac_tmds_lut();
+
+#if VIDEO_LATCH
+    latch_dma_chan = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(latch_dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    dma_channel_configure(latch_dma_chan, &c, latched_fb, NULL, LATCH_BYTES / 4, false);
+#endif
+
+#if VIDEO_PROFILE
+    //10 bit periods per pixel, and the bit clock is the system clock
+    line_period_cycles = 10 * (DVI_TIMING.h_front_porch + DVI_TIMING.h_sync_width +
+        DVI_TIMING.h_back_porch + DVI_TIMING.h_active_pixels);
+    while((line_period_cycles >> (profile_bucket_shift + 1)) >= 8)
+        profile_bucket_shift++;
+
+    //Free running SysTick on the processor clock, used to time scanlines
+    systick_hw->rvr = 0x00FFFFFF;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;
+#endif
+
     prepare_scanline(0);
 
     hw_set_bits(&bus_ctrl_hw->priority, BUSCTRL_BUS_PRIORITY_PROC0_BITS);
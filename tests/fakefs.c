@@ -0,0 +1,581 @@
+/*
+ * FatFs over a RAM card image, see fakefs.h.
+ */
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include "fakefs.h"
+
+#define MAX_FILES       4096
+#define PATH_LEN        256
+#define FAT_ENTRIES     (FAKEFS_SECTOR / 4)
+
+struct fake_file {
+        bool used, dir;
+        char path[PATH_LEN];
+        uint32_t size;
+        uint32_t *clusters;
+        uint32_t n_clusters;
+};
+
+uint8_t *fakefs_card = NULL;
+uint32_t fakefs_card_sectors = 0;
+struct fakefs_stats fakefs_stats;
+bool fakefs_fragment = false;
+bool fakefs_fail_writes = false;
+uint32_t fakefs_readdir_us = 0;
+
+static struct fake_file files[MAX_FILES];
+static uint32_t next_cluster = 2;
+static FATFS *mounted = NULL;
+
+static uint32_t cluster_bytes(void)
+{
+        return FAKEFS_CLUSTER_SECTORS * FAKEFS_SECTOR;
+}
+
+static LBA_t cluster_lba(uint32_t cluster)
+{
+        return FAKEFS_DATA_START + (LBA_t)(cluster - 2) * FAKEFS_CLUSTER_SECTORS;
+}
+
+void fakefs_format(uint32_t sectors)
+{
+        for (int i = 0; i < MAX_FILES; i++)
+                free(files[i].clusters);
+        memset(files, 0, sizeof(files));
+        free(fakefs_card);
+        fakefs_card = calloc(sectors, FAKEFS_SECTOR);
+        fakefs_card_sectors = sectors;
+        next_cluster = 2;
+        mounted = NULL;
+        memset(&fakefs_stats, 0, sizeof(fakefs_stats));
+}
+
+/* "/a//b/" and "a/b" are the same path */
+static void normalise(const char *path, char *out)
+{
+        size_t n = 0;
+
+        for (; *path; path++) {
+                if (*path == '/' && (n == 0 || out[n - 1] == '/'))
+                        continue;
+                if (n < PATH_LEN - 1)
+                        out[n++] = *path;
+        }
+        if (n > 0 && out[n - 1] == '/')
+                n--;
+        out[n] = 0;
+}
+
+static struct fake_file *lookup(const char *path)
+{
+        char name[PATH_LEN];
+
+        normalise(path, name);
+        for (int i = 0; i < MAX_FILES; i++)
+                if (files[i].used && strcasecmp(files[i].path, name) == 0)
+                        return &files[i];
+        return NULL;
+}
+
+static bool parent_exists(const char *name)
+{
+        const char *slash = strrchr(name, '/');
+        char parent[PATH_LEN];
+
+        if (slash == NULL)
+                return true;
+        memcpy(parent, name, slash - name);
+        parent[slash - name] = 0;
+
+        struct fake_file *f = lookup(parent);
+
+        return f != NULL && f->dir;
+}
+
+static struct fake_file *create(const char *path, bool dir, FRESULT *fr)
+{
+        char name[PATH_LEN];
+
+        normalise(path, name);
+        if (!parent_exists(name)) {
+                *fr = FR_NO_PATH;
+                return NULL;
+        }
+        for (int i = 0; i < MAX_FILES; i++) {
+                if (!files[i].used) {
+                        files[i].used = true;
+                        files[i].dir = dir;
+                        strcpy(files[i].path, name);
+                        *fr = FR_OK;
+                        return &files[i];
+                }
+        }
+        *fr = FR_DENIED;
+        return NULL;
+}
+
+static bool grow(struct fake_file *f, uint32_t size)
+{
+        uint32_t need = (size + cluster_bytes() - 1) / cluster_bytes();
+
+        if (need > f->n_clusters) {
+                f->clusters = realloc(f->clusters, need * sizeof(uint32_t));
+                while (f->n_clusters < need) {
+                        uint32_t c = next_cluster++;
+
+                        if (fakefs_fragment)
+                                next_cluster++;
+                        if (cluster_lba(c + 1) > fakefs_card_sectors)
+                                return false;
+                        memset(fakefs_card + cluster_lba(c) * FAKEFS_SECTOR, 0, cluster_bytes());
+                        f->clusters[f->n_clusters++] = c;
+                }
+        }
+        if (size > f->size)
+                f->size = size;
+        return true;
+}
+
+static uint8_t *data_at(struct fake_file *f, uint32_t offset)
+{
+        return fakefs_card + cluster_lba(f->clusters[offset / cluster_bytes()]) * FAKEFS_SECTOR +
+               offset % cluster_bytes();
+}
+
+void fakefs_create(const char *path, const void *data, uint32_t size)
+{
+        FRESULT fr;
+        struct fake_file *f = lookup(path);
+
+        if (f == NULL && (f = create(path, false, &fr)) == NULL)
+                abort();
+        if (!grow(f, size))
+                abort();
+        for (uint32_t i = 0; data != NULL && i < size; i++)
+                *data_at(f, i) = ((const uint8_t *)data)[i];
+}
+
+LBA_t fakefs_lba(const char *path, uint32_t offset)
+{
+        struct fake_file *f = lookup(path);
+
+        if (f == NULL || offset >= f->n_clusters * cluster_bytes())
+                return 0;
+        return (data_at(f, offset) - fakefs_card) / FAKEFS_SECTOR;
+}
+
+/* One command per run of contiguous clusters touched by [offset, +len) */
+static void count_transfer(struct fake_file *f, uint32_t offset, uint32_t len)
+{
+        if (len == 0)
+                return;
+
+        uint32_t first = offset / cluster_bytes();
+        uint32_t last = (offset + len - 1) / cluster_bytes();
+
+        fakefs_stats.commands++;
+        for (uint32_t c = first + 1; c <= last; c++)
+                if (f->clusters[c] != f->clusters[c - 1] + 1)
+                        fakefs_stats.commands++;
+        fakefs_stats.sectors += (offset + len - 1) / FAKEFS_SECTOR - offset / FAKEFS_SECTOR + 1;
+}
+
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt)
+{
+        (void)path;
+        (void)opt;
+        if (fakefs_card == NULL)
+                return FR_NOT_READY;
+        memset(fs, 0, sizeof(*fs));
+        fs->fs_type = 3;
+        fs->pdrv = 0;
+        fs->csize = FAKEFS_CLUSTER_SECTORS;
+        fs->database = FAKEFS_DATA_START;
+        fs->n_fatent = (fakefs_card_sectors - FAKEFS_DATA_START) / FAKEFS_CLUSTER_SECTORS + 2;
+        mounted = fs;
+        return FR_OK;
+}
+
+static struct fake_file *file_of(FIL *fp)
+{
+        if (fp->host_file < 0 || fp->host_file >= MAX_FILES || !files[fp->host_file].used)
+                return NULL;
+        return &files[fp->host_file];
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode)
+{
+        struct fake_file *f = lookup(path);
+        FRESULT fr = FR_OK;
+
+        memset(fp, 0, sizeof(*fp));
+        fp->host_file = -1;
+        if (mounted == NULL)
+                return FR_NOT_ENABLED;
+        if (f != NULL && f->dir)
+                return FR_DENIED;
+        if (f != NULL && (mode & FA_CREATE_NEW))
+                return FR_EXIST;
+        if (f == NULL) {
+                if (!(mode & (FA_CREATE_NEW | FA_CREATE_ALWAYS | FA_OPEN_ALWAYS)))
+                        return FR_NO_FILE;
+                if (fakefs_fail_writes)
+                        return FR_DISK_ERR;
+                if ((f = create(path, false, &fr)) == NULL)
+                        return fr;
+        } else if (mode & FA_CREATE_ALWAYS) {
+                if (fakefs_fail_writes)
+                        return FR_DISK_ERR;
+                f->size = 0;
+                f->n_clusters = 0;
+        }
+
+        fp->obj.fs = mounted;
+        fp->obj.objsize = f->size;
+        fp->obj.sclust = f->n_clusters ? f->clusters[0] : 0;
+        fp->flag = mode;
+        fp->host_file = f - files;
+        if ((mode & FA_OPEN_APPEND) == FA_OPEN_APPEND)
+                fp->fptr = f->size;
+        return FR_OK;
+}
+
+FRESULT f_close(FIL *fp)
+{
+        FRESULT fr = f_sync(fp);
+
+        fp->host_file = -1;
+        return fr;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br)
+{
+        struct fake_file *f = file_of(fp);
+
+        *br = 0;
+        if (f == NULL || !(fp->flag & FA_READ))
+                return FR_DENIED;
+        if (btr > f->size - fp->fptr)
+                btr = fp->fptr < f->size ? f->size - fp->fptr : 0;
+
+        count_transfer(f, fp->fptr, btr);
+        for (UINT i = 0; i < btr; i++)
+                ((uint8_t *)buff)[i] = *data_at(f, fp->fptr + i);
+        fp->fptr += btr;
+        *br = btr;
+        return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+        struct fake_file *f = file_of(fp);
+
+        *bw = 0;
+        if (f == NULL || !(fp->flag & FA_WRITE))
+                return FR_DENIED;
+        if (fakefs_fail_writes) {
+                fakefs_stats.failed_writes++;
+                return FR_DISK_ERR;
+        }
+        if (!grow(f, fp->fptr + btw))
+                return FR_DENIED;
+
+        count_transfer(f, fp->fptr, btw);
+        for (UINT i = 0; i < btw; i++)
+                *data_at(f, fp->fptr + i) = ((const uint8_t *)buff)[i];
+        fp->fptr += btw;
+        fp->obj.objsize = f->size;
+        *bw = btw;
+        return FR_OK;
+}
+
+/* Without a link map, FatFs follows the FAT from the file start (or from
+ * the current cluster, going forward): one FAT sector read per
+ * FAT_ENTRIES clusters.
+ */
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs)
+{
+        struct fake_file *f = file_of(fp);
+
+        if (f == NULL)
+                return FR_INVALID_OBJECT;
+
+#if FF_USE_FASTSEEK
+        if (ofs == CREATE_LINKMAP) {
+                DWORD *tbl = fp->cltbl;
+                DWORD size = tbl[0], need = 2;
+                DWORD *p = tbl + 1;
+
+                for (uint32_t i = 0; i < f->n_clusters; need += 2) {
+                        uint32_t run = 1;
+
+                        while (i + run < f->n_clusters && f->clusters[i + run] == f->clusters[i] + run)
+                                run++;
+                        if (need + 2 <= size) {
+                                *p++ = run;
+                                *p++ = f->clusters[i];
+                        }
+                        i += run;
+                }
+                tbl[0] = need;
+                if (need > size)
+                        return FR_NOT_ENOUGH_CORE;
+                *p = 0;
+                return FR_OK;
+        }
+#endif
+
+        if (ofs > f->size) {
+                if (!(fp->flag & FA_WRITE))
+                        ofs = f->size;
+                else if (fakefs_fail_writes)
+                        return FR_DISK_ERR;
+                else if (!grow(f, ofs))
+                        return FR_DENIED;
+                fp->obj.objsize = f->size;
+        }
+
+#if FF_USE_FASTSEEK
+        if (fp->cltbl == NULL && ofs > 0) {
+#else
+        if (ofs > 0) {
+#endif
+                uint32_t from = ofs >= fp->fptr ? fp->fptr / cluster_bytes() : 0;
+                uint32_t to = (ofs - 1) / cluster_bytes();
+                uint32_t reads = to / FAT_ENTRIES - from / FAT_ENTRIES + (from == 0 && to > 0);
+
+                fakefs_stats.fat_reads += reads;
+                fakefs_stats.commands += reads;
+                fakefs_stats.sectors += reads;
+        }
+
+        fp->fptr = ofs;
+        return FR_OK;
+}
+
+FRESULT f_truncate(FIL *fp)
+{
+        struct fake_file *f = file_of(fp);
+
+        if (f == NULL)
+                return FR_INVALID_OBJECT;
+        f->size = fp->fptr;
+        fp->obj.objsize = f->size;
+        return FR_OK;
+}
+
+FRESULT f_sync(FIL *fp)
+{
+        if (file_of(fp) == NULL)
+                return FR_INVALID_OBJECT;
+        if (fakefs_fail_writes && (fp->flag & FA_WRITE)) {
+                fakefs_stats.failed_writes++;
+                return FR_DISK_ERR;
+        }
+        fakefs_stats.syncs++;
+        return FR_OK;
+}
+
+/* Allocate the file contiguously; like FatFs, only for an empty file */
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt)
+{
+        struct fake_file *f = file_of(fp);
+
+        (void)opt;
+        if (f == NULL || !(fp->flag & FA_WRITE))
+                return FR_DENIED;
+        if (f->size != 0)
+                return FR_DENIED;
+        if (fakefs_fail_writes)
+                return FR_DISK_ERR;
+
+        bool fragment = fakefs_fragment;
+
+        fakefs_fragment = false;
+        bool ok = grow(f, fsz);
+        fakefs_fragment = fragment;
+        if (!ok)
+                return FR_DENIED;
+        fp->obj.objsize = f->size;
+        fp->obj.sclust = f->clusters[0];
+        return FR_OK;
+}
+
+FRESULT f_opendir(DIR *dp, const TCHAR *path)
+{
+        char name[PATH_LEN];
+
+        normalise(path, name);
+        memset(dp, 0, sizeof(*dp));
+        dp->host_dir = -1;
+        if (name[0] != 0) {
+                struct fake_file *f = lookup(name);
+
+                if (f == NULL || !f->dir)
+                        return FR_NO_PATH;
+                dp->host_dir = f - files;
+        }
+        dp->obj.fs = mounted;
+        return FR_OK;
+}
+
+FRESULT f_closedir(DIR *dp)
+{
+        (void)dp;
+        return FR_OK;
+}
+
+static bool in_dir(const struct fake_file *f, int dir)
+{
+        const char *slash = strrchr(f->path, '/');
+
+        if (dir < 0)
+                return slash == NULL;
+
+        size_t n = strlen(files[dir].path);
+
+        return slash != NULL && (size_t)(slash - f->path) == n &&
+               strncasecmp(f->path, files[dir].path, n) == 0;
+}
+
+static void fill_info(const struct fake_file *f, FILINFO *fno)
+{
+        const char *slash = strrchr(f->path, '/');
+
+        memset(fno, 0, sizeof(*fno));
+        strcpy(fno->fname, slash ? slash + 1 : f->path);
+        fno->fsize = f->size;
+        fno->fattrib = f->dir ? AM_DIR : AM_ARC;
+}
+
+FRESULT f_readdir(DIR *dp, FILINFO *fno)
+{
+        fakefs_stats.dir_reads++;
+        host_time_us += fakefs_readdir_us;
+        if (fno == NULL) {
+                dp->host_next = 0;
+                return FR_OK;
+        }
+
+        while (dp->host_next < MAX_FILES) {
+                struct fake_file *f = &files[dp->host_next++];
+
+                if (f->used && in_dir(f, dp->host_dir)) {
+                        fill_info(f, fno);
+                        return FR_OK;
+                }
+        }
+
+        memset(fno, 0, sizeof(*fno));
+        return FR_OK;
+}
+
+FRESULT f_stat(const TCHAR *path, FILINFO *fno)
+{
+        struct fake_file *f = lookup(path);
+
+        if (f == NULL)
+                return FR_NO_FILE;
+        if (fno != NULL)
+                fill_info(f, fno);
+        return FR_OK;
+}
+
+FRESULT f_mkdir(const TCHAR *path)
+{
+        FRESULT fr;
+
+        if (lookup(path) != NULL)
+                return FR_EXIST;
+        if (fakefs_fail_writes)
+                return FR_DISK_ERR;
+        create(path, true, &fr);
+        return fr;
+}
+
+FRESULT f_unlink(const TCHAR *path)
+{
+        struct fake_file *f = lookup(path);
+
+        if (f == NULL)
+                return FR_NO_FILE;
+        free(f->clusters);
+        memset(f, 0, sizeof(*f));
+        return FR_OK;
+}
+
+FRESULT f_rename(const TCHAR *path_old, const TCHAR *path_new)
+{
+        struct fake_file *f = lookup(path_old);
+        char name[PATH_LEN];
+
+        if (f == NULL)
+                return FR_NO_FILE;
+        if (lookup(path_new) != NULL)
+                return FR_EXIST;
+        if (fakefs_fail_writes)
+                return FR_DISK_ERR;
+        normalise(path_new, name);
+        if (!parent_exists(name))
+                return FR_NO_PATH;
+        strcpy(f->path, name);
+        return FR_OK;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+        (void)pdrv;
+        return 0;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+        (void)pdrv;
+        return 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
+        if (pdrv != 0 || sector + count > fakefs_card_sectors)
+                return RES_PARERR;
+        memcpy(buff, fakefs_card + sector * FAKEFS_SECTOR, count * FAKEFS_SECTOR);
+        fakefs_stats.commands++;
+        fakefs_stats.sectors += count;
+        return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+        if (pdrv != 0 || sector + count > fakefs_card_sectors)
+                return RES_PARERR;
+        if (fakefs_fail_writes) {
+                fakefs_stats.failed_writes++;
+                return RES_ERROR;
+        }
+        memcpy(fakefs_card + sector * FAKEFS_SECTOR, buff, count * FAKEFS_SECTOR);
+        fakefs_stats.commands++;
+        fakefs_stats.sectors += count;
+        return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+        if (pdrv != 0)
+                return RES_PARERR;
+        switch (cmd) {
+        case CTRL_SYNC:
+                if (fakefs_fail_writes) {
+                        fakefs_stats.failed_writes++;
+                        return RES_ERROR;
+                }
+                fakefs_stats.syncs++;
+                return RES_OK;
+        case MMC_GET_TYPE:
+                *(BYTE *)buff = CT_SD2 | CT_BLOCK;
+                return RES_OK;
+        }
+        return RES_PARERR;
+}
@@ -0,0 +1,48 @@
+/*
+ * A FatFs stand-in over a RAM card image, for the host tests.
+ *
+ * Files are cluster lists on the card, so the firmware's fast-seek link
+ * maps and raw LBA access see the same sectors FatFs does, and sdcard.c
+ * can serve them over SPI.  Card commands are counted to compare access
+ * paths without real timings.
+ */
+
+#ifndef FAKEFS_H
+#define FAKEFS_H
+
+#include "ff.h"
+#include "diskio.h"
+
+#define FAKEFS_SECTOR           512
+#define FAKEFS_CLUSTER_SECTORS  8
+#define FAKEFS_DATA_START       2048    /* Card sector of cluster 2 */
+
+struct fakefs_stats {
+        uint32_t commands;      /* Card read/write commands, FAT lookups included */
+        uint32_t sectors;       /* Sectors moved by them */
+        uint32_t fat_reads;     /* Of the commands, FAT sectors read to seek */
+        uint32_t syncs;
+        uint32_t dir_reads;     /* f_readdir() calls */
+        uint32_t failed_writes; /* Writes and syncs refused by fakefs_fail_writes */
+};
+
+extern uint8_t *fakefs_card;
+extern uint32_t fakefs_card_sectors;
+extern struct fakefs_stats fakefs_stats;
+/* Leave a free cluster after each one allocated, so files fragment */
+extern bool fakefs_fragment;
+/* Writes (FatFs and disk_write) fail while set */
+extern bool fakefs_fail_writes;
+/* Host time each f_readdir() takes, to model slow folder scans */
+extern uint32_t fakefs_readdir_us;
+
+/* Blank card of the given size, everything unmounted and deleted */
+void fakefs_format(uint32_t sectors);
+
+/* Create path holding size bytes of data (may be NULL for zeros) */
+void fakefs_create(const char *path, const void *data, uint32_t size);
+
+/* Card sector holding byte offset of path's data, or 0 */
+LBA_t fakefs_lba(const char *path, uint32_t offset);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Host implementations behind tests/stubs/pico_host.h.
+ */
+
+#include <stdlib.h>
+
+#include "pico_host.h"
+
+uint64_t host_time_us = 0;
+
+static bus_ctrl_hw_t bus_ctrl;
+bus_ctrl_hw_t *bus_ctrl_hw = &bus_ctrl;
+
+static systick_hw_t systick;
+systick_hw_t *systick_hw = &systick;
+
+struct host_dma_channel host_dma[HOST_DMA_CHANNELS];
+
+bool host_gpio[30];
+
+spi_inst_t host_spi0;
+uint8_t (*host_spi_device)(uint8_t mosi) = NULL;
+
+const struct dvi_timing dvi_timing_640x480p_60hz = {
+        .bit_clk_khz = 252000,
+        .h_front_porch = 16, .h_sync_width = 96, .h_back_porch = 48, .h_active_pixels = 640,
+        .v_front_porch = 10, .v_sync_width = 2, .v_back_porch = 33, .v_active_lines = 480,
+};
+
+static uint32_t sys_khz = 125000;
+
+uint next_striped_spin_lock_num(void)
+{
+        return 0;
+}
+
+uint32_t clock_get_hz(int clk)
+{
+        return clk == clk_sys ? sys_khz * 1000 : 125000000;
+}
+
+bool set_sys_clock_khz(uint32_t khz, bool required)
+{
+        (void)required;
+        sys_khz = khz;
+        return true;
+}
+
+void queue_init(queue_t *q, uint element_size, uint element_count)
+{
+        if (element_size * element_count > HOST_QUEUE_BYTES)
+                abort();
+        memset(q, 0, sizeof(*q));
+        q->element_size = element_size;
+        q->capacity = element_count;
+}
+
+bool queue_try_add(queue_t *q, const void *data)
+{
+        if (q->count == q->capacity)
+                return false;
+        memcpy(q->data + ((q->head + q->count) % q->capacity) * q->element_size, data, q->element_size);
+        q->count++;
+        return true;
+}
+
+bool queue_try_remove(queue_t *q, void *data)
+{
+        if (q->count == 0)
+                return false;
+        memcpy(data, q->data + q->head * q->element_size, q->element_size);
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        return true;
+}
+
+/* Nothing else runs on the host, so blocking forever is a test bug */
+void queue_add_blocking(queue_t *q, const void *data)
+{
+        if (!queue_try_add(q, data)) {
+                fprintf(stderr, "queue_add_blocking: queue full\n");
+                abort();
+        }
+}
+
+void queue_remove_blocking(queue_t *q, void *data)
+{
+        if (!queue_try_remove(q, data)) {
+                fprintf(stderr, "queue_remove_blocking: queue empty\n");
+                abort();
+        }
+}
+
+int dma_claim_unused_channel(bool required)
+{
+        for (int i = 0; i < HOST_DMA_CHANNELS; i++) {
+                if (!host_dma[i].claimed) {
+                        host_dma[i].claimed = true;
+                        return i;
+                }
+        }
+        if (required)
+                abort();
+        return -1;
+}
+
+dma_channel_config dma_channel_get_default_config(uint chan)
+{
+        (void)chan;
+        return (dma_channel_config){ .size = DMA_SIZE_32, .read_increment = true,
+                                     .write_increment = false, .dreq = 0x3f };
+}
+
+static uint8_t spi_exchange(uint8_t mosi)
+{
+        return host_spi_device != NULL ? host_spi_device(mosi) : 0xff;
+}
+
+/* Memory to memory; SPI transfers need both channels, see below */
+void dma_channel_start(uint chan)
+{
+        struct host_dma_channel *c = &host_dma[chan];
+
+        if (!c->cfg.read_increment || !c->cfg.write_increment) {
+                fprintf(stderr, "dma: channel %u has a fixed address\n", chan);
+                abort();
+        }
+        memmove((void *)c->write_addr, (const void *)c->read_addr, (size_t)c->count << c->cfg.size);
+}
+
+void dma_start_channel_mask(uint32_t mask)
+{
+        volatile void *dr = &host_spi0.hw.dr;
+        int tx = -1, rx = -1;
+
+        for (int i = 0; i < HOST_DMA_CHANNELS; i++) {
+                if (!(mask & (1u << i)))
+                        continue;
+                if (host_dma[i].write_addr == dr)
+                        tx = i;
+                else if (host_dma[i].read_addr == dr)
+                        rx = i;
+                else
+                        dma_channel_start(i);
+        }
+
+        if (tx < 0 && rx < 0)
+                return;
+        if (tx < 0 || rx < 0 || host_dma[tx].count != host_dma[rx].count ||
+            host_dma[tx].cfg.size != DMA_SIZE_8 || host_dma[rx].cfg.size != DMA_SIZE_8) {
+                fprintf(stderr, "dma: SPI needs matching 8-bit tx and rx channels\n");
+                abort();
+        }
+
+        const volatile uint8_t *src = host_dma[tx].read_addr;
+        volatile uint8_t *dst = host_dma[rx].write_addr;
+
+        for (uint32_t n = 0; n < host_dma[tx].count; n++) {
+                uint8_t miso = spi_exchange(*src);
+
+                *dst = miso;
+                if (host_dma[tx].cfg.read_increment)
+                        src++;
+                if (host_dma[rx].cfg.write_increment)
+                        dst++;
+        }
+}
+
+/* The RP2040's prescale and post-divide search, from clk_peri */
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate)
+{
+        uint freq_in = clock_get_hz(clk_peri);
+        uint prescale, postdiv;
+
+        for (prescale = 2; prescale <= 254; prescale += 2)
+                if ((uint64_t)freq_in < (uint64_t)(prescale + 2) * 256 * baudrate)
+                        break;
+        for (postdiv = 256; postdiv > 1; --postdiv)
+                if (freq_in / (prescale * (postdiv - 1)) > baudrate)
+                        break;
+
+        spi->baudrate = freq_in / (prescale * postdiv);
+        return spi->baudrate;
+}
+
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len)
+{
+        (void)spi;
+        for (size_t i = 0; i < len; i++)
+                dst[i] = spi_exchange(src[i]);
+        return (int)len;
+}
+
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len)
+{
+        (void)spi;
+        for (size_t i = 0; i < len; i++)
+                spi_exchange(src[i]);
+        return (int)len;
+}
+
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len)
+{
+        (void)spi;
+        for (size_t i = 0; i < len; i++)
+                dst[i] = spi_exchange(repeated_tx_data);
+        return (int)len;
+}
+
+void dma_channel_configure(uint chan, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint count, bool trigger)
+{
+        host_dma[chan].cfg = *config;
+        host_dma[chan].write_addr = write_addr;
+        host_dma[chan].read_addr = read_addr;
+        host_dma[chan].count = count;
+        if (trigger)
+                dma_channel_start(chan);
+}
+
+void dma_channel_set_read_addr(uint chan, const volatile void *read_addr, bool trigger)
+{
+        host_dma[chan].read_addr = read_addr;
+        if (trigger)
+                dma_channel_start(chan);
+}
+
+void dma_channel_set_write_addr(uint chan, volatile void *write_addr, bool trigger)
+{
+        host_dma[chan].write_addr = write_addr;
+        if (trigger)
+                dma_channel_start(chan);
+}
+
+void dma_channel_set_trans_count(uint chan, uint32_t count, bool trigger)
+{
+        host_dma[chan].count = count;
+        if (trigger)
+                dma_channel_start(chan);
+}
+
+/* Same buffer count and size as the firmware's libdvi build */
+void dvi_init(struct dvi_inst *inst, uint spinlock_tmds_queue, uint spinlock_colour_queue)
+{
+        (void)spinlock_tmds_queue;
+        (void)spinlock_colour_queue;
+
+        queue_init(&inst->q_tmds_valid, sizeof(void *), DVI_N_TMDS_BUFFERS);
+        queue_init(&inst->q_tmds_free, sizeof(void *), DVI_N_TMDS_BUFFERS);
+
+        for (int i = 0; i < DVI_N_TMDS_BUFFERS; i++) {
+                void *buf = calloc(inst->timing->h_active_pixels / 2, sizeof(uint32_t));
+                queue_add_blocking(&inst->q_tmds_free, &buf);
+        }
+}
+
+void tmds_encode_1bpp(const uint32_t *pixbuf, uint32_t *symbuf, size_t n_pix)
+{
+        for (size_t i = 0; i < n_pix; i += 2) {
+                uint32_t p0 = (pixbuf[i / 32] >> (i % 32)) & 1;
+                uint32_t p1 = (pixbuf[i / 32] >> (i % 32 + 1)) & 1;
+
+                symbuf[i / 2] = (p0 ? TMDS_SYMBOL_1 : TMDS_SYMBOL_0) |
+                                (p1 ? TMDS_SYMBOL_1 : TMDS_SYMBOL_0) << 10;
+        }
+}
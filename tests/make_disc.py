@@ -0,0 +1,29 @@
+#!/usr/bin/env python3
+#
+# Write a disc image for test_packed.c with every kind of chunk
+# pack_disc.py makes: stored (random), empty (zeroes), LZ4 (text-like),
+# and a short compressed chunk at the end.
+#
+#   tests/make_disc.py disc.bin
+
+import random
+import sys
+
+CHUNK = 4096
+
+rng = random.Random(1)
+words = [b'System', b'Finder', b'Desk', b'Scrapbook', b'Note Pad', b'\x00\x00', b'ICN#']
+
+
+def text(n):
+    out = bytearray()
+    while len(out) < n:
+        out += rng.choice(words) + bytes([rng.randrange(32, 127)])
+    return bytes(out[:n])
+
+
+image = (rng.randbytes(2 * CHUNK) + bytes(2 * CHUNK) + text(6 * CHUNK) +
+         rng.randbytes(CHUNK) + text(1000))
+
+with open(sys.argv[1], 'wb') as f:
+    f.write(image)
@@ -0,0 +1,208 @@
+/*
+ * SD card SPI protocol model, see sdcard.h.
+ */
+
+#include "sdcard.h"
+#include "fakefs.h"
+
+#define BLOCK   512
+
+struct sdcard_stats sdcard_stats;
+uint32_t sdcard_read_max_hz = UINT32_MAX;
+uint32_t sdcard_write_max_hz = UINT32_MAX;
+void (*sdcard_written)(uint32_t lba) = NULL;
+
+static enum {
+        IDLE,
+        READ_MULTI,     /* Streaming blocks until CMD12 */
+        WRITE_TOKEN,    /* Waiting for a data token */
+        WRITE_DATA,
+} state;
+
+static bool multi_write;
+static uint cs;
+static uint8_t cmd[6];
+static unsigned int cmd_len;
+static uint32_t lba;
+static uint8_t block[BLOCK + 2];
+static unsigned int block_len;
+static uint32_t garble_count;
+
+/* MISO bytes queued to go out, 0xff when empty */
+static uint8_t out[BLOCK + 16];
+static unsigned int out_head, out_len;
+
+static void put(uint8_t b)
+{
+        out[(out_head + out_len++) % sizeof(out)] = b;
+}
+
+static uint16_t crc16(const uint8_t *p, unsigned int len)
+{
+        uint16_t crc = 0;
+
+        while (len--) {
+                crc ^= *p++ << 8;
+                for (int i = 0; i < 8; i++)
+                        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        return crc;
+}
+
+/* Flip a bit in every 4KB moved above the limit */
+static void garble(uint8_t *data, uint32_t max_hz)
+{
+        if (spi_get_baudrate(spi0) <= max_hz)
+                return;
+        for (int i = 0; i < BLOCK; i++)
+                if (++garble_count % 4096 == 0)
+                        data[i] ^= 0x10;
+}
+
+static bool in_range(void)
+{
+        return lba < fakefs_card_sectors;
+}
+
+static void queue_block(void)
+{
+        uint8_t data[BLOCK];
+
+        memcpy(data, fakefs_card + lba * BLOCK, BLOCK);
+        //The CRC is the card's, so corruption on the wire shows up
+        uint16_t crc = crc16(data, BLOCK);
+
+        garble(data, sdcard_read_max_hz);
+        put(0xff);
+        put(0xfe);
+        for (int i = 0; i < BLOCK; i++)
+                put(data[i]);
+        put(crc >> 8);
+        put(crc);
+        lba++;
+        sdcard_stats.blocks++;
+}
+
+static void command(void)
+{
+        uint32_t arg = (uint32_t)cmd[1] << 24 | cmd[2] << 16 | cmd[3] << 8 | cmd[4];
+
+        out_len = 0;
+        switch (cmd[0] & 0x3f) {
+        case 12:
+                state = IDLE;
+                put(0xff);      //Stuff byte
+                put(0x00);
+                return;
+        case 17:
+        case 18:
+                lba = arg;
+                sdcard_stats.commands++;
+                put(0xff);
+                if (!in_range()) {
+                        put(0x40);
+                        return;
+                }
+                put(0x00);
+                queue_block();
+                if ((cmd[0] & 0x3f) == 18)
+                        state = READ_MULTI;
+                return;
+        case 24:
+        case 25:
+                lba = arg;
+                sdcard_stats.commands++;
+                put(0xff);
+                if (!in_range()) {
+                        put(0x40);
+                        return;
+                }
+                put(0x00);
+                multi_write = (cmd[0] & 0x3f) == 25;
+                state = WRITE_TOKEN;
+                return;
+        }
+        put(0xff);
+        put(0x04);      //Illegal command
+}
+
+static void write_block(void)
+{
+        uint8_t *data = block;
+
+        garble(data, sdcard_write_max_hz);
+        if (in_range()) {
+                memcpy(fakefs_card + lba * BLOCK, data, BLOCK);
+                if (sdcard_written)
+                        sdcard_written(lba);
+                put(0x05);      //Accepted
+        } else {
+                put(0x0d);      //Write error
+        }
+        lba++;
+        sdcard_stats.blocks++;
+        put(0x00);              //Busy programming
+        put(0x00);
+        state = multi_write ? WRITE_TOKEN : IDLE;
+}
+
+static uint8_t exchange(uint8_t mosi)
+{
+        if (host_gpio[cs]) {
+                state = IDLE;
+                cmd_len = 0;
+                out_len = 0;
+                return 0xff;
+        }
+        sdcard_stats.bytes++;
+
+        uint8_t miso = 0xff;
+
+        if (out_len > 0) {
+                miso = out[out_head];
+                out_head = (out_head + 1) % sizeof(out);
+                out_len--;
+        } else if (state == READ_MULTI && cmd_len == 0 && mosi == 0xff) {
+                queue_block();
+        }
+
+        switch (state) {
+        case WRITE_TOKEN:
+                if (mosi == 0xfe || mosi == 0xfc) {
+                        state = WRITE_DATA;
+                        block_len = 0;
+                } else if (mosi == 0xfd && multi_write) {
+                        state = IDLE;
+                        put(0xff);
+                        put(0x00);      //Busy finishing
+                }
+                return miso;
+        case WRITE_DATA:
+                block[block_len++] = mosi;
+                if (block_len == BLOCK + 2)
+                        write_block();
+                return miso;
+        default:
+                break;
+        }
+
+        if (cmd_len > 0 || (mosi & 0xc0) == 0x40) {
+                cmd[cmd_len++] = mosi;
+                if (cmd_len == sizeof(cmd)) {
+                        cmd_len = 0;
+                        command();
+                }
+        }
+        return miso;
+}
+
+void sdcard_attach(uint cs_pin)
+{
+        cs = cs_pin;
+        host_gpio[cs] = true;
+        state = IDLE;
+        out_len = 0;
+        cmd_len = 0;
+        memset(&sdcard_stats, 0, sizeof(sdcard_stats));
+        host_spi_device = exchange;
+}
@@ -0,0 +1,30 @@
+/*
+ * An SD card in SPI mode, over fakefs's card image, for sd_spi.c.
+ *
+ * It answers CMD12/17/18/24/25 byte by byte behind host_spi_device, with
+ * data CRCs, and can be made to garble reads or writes above a clock rate
+ * to exercise clock tuning.
+ */
+
+#ifndef SDCARD_H
+#define SDCARD_H
+
+#include "pico_host.h"
+
+struct sdcard_stats {
+        uint32_t commands;      /* Read and write commands */
+        uint32_t blocks;
+        uint32_t bytes;         /* Every byte clocked, commands included */
+};
+
+extern struct sdcard_stats sdcard_stats;
+/* Above these SPI rates, one bit in every 4KB read or written is flipped */
+extern uint32_t sdcard_read_max_hz;
+extern uint32_t sdcard_write_max_hz;
+/* If set, called as each written block lands on the card */
+extern void (*sdcard_written)(uint32_t lba);
+
+/* Answer on spi0 while cs_pin is low */
+void sdcard_attach(uint cs_pin);
+
+#endif
@@ -0,0 +1,26 @@
+/* FatFs low level disk interface, served from tests/fakefs.c's card image */
+
+#ifndef DISKIO_DEFINED
+#define DISKIO_DEFINED
+
+#include "ff.h"
+
+typedef BYTE DSTATUS;
+
+typedef enum { RES_OK = 0, RES_ERROR, RES_WRPRT, RES_NOTRDY, RES_PARERR } DRESULT;
+
+DSTATUS disk_initialize(BYTE pdrv);
+DSTATUS disk_status(BYTE pdrv);
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count);
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count);
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff);
+
+#define CTRL_SYNC       0
+#define MMC_GET_TYPE    50
+
+#define CT_MMC          0x01
+#define CT_SD1          0x02
+#define CT_SD2          0x04
+#define CT_BLOCK        0x08
+
+#endif
@@ -0,0 +1,113 @@
+/* The FatFs R0.15 interface the firmware uses.  tests/fakefs.c implements
+ * it over a RAM card image; the ffconf.h options can be overridden with
+ * compile definitions to test builds without them.
+ */
+
+#ifndef FF_DEFINED
+#define FF_DEFINED
+
+#include "pico_host.h"
+
+#ifndef FF_USE_FASTSEEK
+#define FF_USE_FASTSEEK 1
+#endif
+#ifndef FF_USE_EXPAND
+#define FF_USE_EXPAND   1
+#endif
+#define FF_MIN_SS       512
+#define FF_MAX_SS       512
+
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+typedef char TCHAR;
+typedef DWORD FSIZE_t;
+typedef DWORD LBA_t;
+
+typedef struct {
+        BYTE fs_type;
+        BYTE pdrv;
+        BYTE csize;             /* Sectors per cluster */
+        DWORD n_fatent;
+        LBA_t database;         /* First sector of cluster 2 */
+} FATFS;
+
+typedef struct {
+        FATFS *fs;
+        DWORD sclust;
+        FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+        FFOBJID obj;
+        BYTE flag;
+        BYTE err;
+        FSIZE_t fptr;
+#if FF_USE_FASTSEEK
+        DWORD *cltbl;
+#endif
+        int host_file;
+} FIL;
+
+typedef struct {
+        FFOBJID obj;
+        int host_dir;
+        int host_next;
+} DIR;
+
+typedef struct {
+        FSIZE_t fsize;
+        WORD fdate;
+        WORD ftime;
+        BYTE fattrib;
+        TCHAR altname[13];
+        TCHAR fname[256];
+} FILINFO;
+
+typedef enum {
+        FR_OK = 0, FR_DISK_ERR, FR_INT_ERR, FR_NOT_READY, FR_NO_FILE, FR_NO_PATH,
+        FR_INVALID_NAME, FR_DENIED, FR_EXIST, FR_INVALID_OBJECT, FR_WRITE_PROTECTED,
+        FR_INVALID_DRIVE, FR_NOT_ENABLED, FR_NO_FILESYSTEM, FR_MKFS_ABORTED, FR_TIMEOUT,
+        FR_LOCKED, FR_NOT_ENOUGH_CORE, FR_TOO_MANY_OPEN_FILES, FR_INVALID_PARAMETER
+} FRESULT;
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br);
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT f_lseek(FIL *fp, FSIZE_t ofs);
+FRESULT f_truncate(FIL *fp);
+FRESULT f_sync(FIL *fp);
+FRESULT f_opendir(DIR *dp, const TCHAR *path);
+FRESULT f_closedir(DIR *dp);
+FRESULT f_readdir(DIR *dp, FILINFO *fno);
+FRESULT f_mkdir(const TCHAR *path);
+FRESULT f_unlink(const TCHAR *path);
+FRESULT f_rename(const TCHAR *path_old, const TCHAR *path_new);
+FRESULT f_stat(const TCHAR *path, FILINFO *fno);
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt);
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt);
+
+#define f_size(fp) ((fp)->obj.objsize)
+#define f_tell(fp) ((fp)->fptr)
+#define f_error(fp) ((fp)->err)
+
+#define CREATE_LINKMAP ((FSIZE_t)0 - 1)
+
+#define FA_READ                 0x01
+#define FA_WRITE                0x02
+#define FA_OPEN_EXISTING        0x00
+#define FA_CREATE_NEW           0x04
+#define FA_CREATE_ALWAYS        0x08
+#define FA_OPEN_ALWAYS          0x10
+#define FA_OPEN_APPEND          0x30
+
+#define AM_RDO  0x01
+#define AM_HID  0x02
+#define AM_SYS  0x04
+#define AM_DIR  0x10
+#define AM_ARC  0x20
+
+#endif
@@ -0,0 +1,22 @@
+/* Mac keycodes from umac's keymap.h, the ones the firmware names */
+
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+enum {
+        MKC_A = 0x00, MKC_S = 0x01, MKC_D = 0x02, MKC_F = 0x03, MKC_H = 0x04, MKC_G = 0x05,
+        MKC_Z = 0x06, MKC_X = 0x07, MKC_C = 0x08, MKC_V = 0x09, MKC_B = 0x0b, MKC_Q = 0x0c,
+        MKC_W = 0x0d, MKC_E = 0x0e, MKC_R = 0x0f, MKC_Y = 0x10, MKC_T = 0x11, MKC_1 = 0x12,
+        MKC_2 = 0x13, MKC_3 = 0x14, MKC_4 = 0x15, MKC_6 = 0x16, MKC_5 = 0x17, MKC_Equal = 0x18,
+        MKC_9 = 0x19, MKC_7 = 0x1a, MKC_Minus = 0x1b, MKC_8 = 0x1c, MKC_0 = 0x1d,
+        MKC_RightBracket = 0x1e, MKC_O = 0x1f, MKC_U = 0x20, MKC_LeftBracket = 0x21,
+        MKC_I = 0x22, MKC_P = 0x23, MKC_Return = 0x24, MKC_L = 0x25, MKC_J = 0x26,
+        MKC_SingleQuote = 0x27, MKC_K = 0x28, MKC_SemiColon = 0x29, MKC_BackSlash = 0x2a,
+        MKC_Comma = 0x2b, MKC_Slash = 0x2c, MKC_N = 0x2d, MKC_M = 0x2e, MKC_Period = 0x2f,
+        MKC_Tab = 0x30, MKC_Space = 0x31, MKC_Grave = 0x32, MKC_BackSpace = 0x33,
+        MKC_Escape = 0x35, MKC_Shift = 0x38, MKC_Left = 0x46, MKC_Right = 0x42,
+        MKC_Enter = 0x4c, MKC_Up = 0x4d, MKC_Down = 0x48,
+        MKC_F8 = 0x64, MKC_F9 = 0x65, MKC_F11 = 0x67, MKC_F10 = 0x6d, MKC_F12 = 0x6f,
+};
+
+#endif
@@ -0,0 +1 @@
+int m68k_cycles_run(void);
@@ -0,0 +1,183 @@
+/*
+ * Host stand-ins for the parts of the Pico SDK and libdvi the firmware uses,
+ * so the firmware sources can be built and exercised on a PC.  Only what the tests need
+ * is modelled: time is a counter the test advances, DMA copies immediately,
+ * and queues are plain rings.
+ */
+
+#ifndef PICO_HOST_H
+#define PICO_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef unsigned int uint;
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define __not_in_flash(group)
+#define __not_in_flash_func(f) f
+#define __time_critical_func(f) f
+#define __scratch_x(group)
+#define __scratch_y(group)
+#define __force_inline inline __attribute__((always_inline))
+
+static inline void tight_loop_contents(void) {}
+static inline void __dmb(void) {}
+static inline void __wfe(void) {}
+static inline void __wfi(void) {}
+static inline void __sev(void) {}
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+static inline uint get_core_num(void) { return 0; }
+uint next_striped_spin_lock_num(void);
+void multicore_launch_core1(void (*entry)(void));
+
+/* Time, in microseconds since "boot", only moves when a test advances it */
+extern uint64_t host_time_us;
+
+typedef uint64_t absolute_time_t;
+
+static inline uint64_t time_us_64(void) { return host_time_us; }
+static inline uint32_t time_us_32(void) { return (uint32_t)host_time_us; }
+static inline absolute_time_t get_absolute_time(void) { return host_time_us; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to)
+{
+        return (int64_t)(to - from);
+}
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+static inline void sleep_us(uint64_t us) { host_time_us += us; }
+static inline void sleep_ms(uint32_t ms) { host_time_us += (uint64_t)ms * 1000; }
+
+/* Clocks and power */
+#define clk_sys 5
+#define clk_peri 6
+#define VREG_VOLTAGE_1_20 1
+uint32_t clock_get_hz(int clk);
+bool set_sys_clock_khz(uint32_t khz, bool required);
+static inline void vreg_set_voltage(int vsel) { (void)vsel; }
+
+typedef struct { volatile uint32_t priority; } bus_ctrl_hw_t;
+extern bus_ctrl_hw_t *bus_ctrl_hw;
+#define BUSCTRL_BUS_PRIORITY_PROC0_BITS 0x1
+#define BUSCTRL_BUS_PRIORITY_PROC1_BITS 0x10
+static inline void hw_set_bits(volatile uint32_t *addr, uint32_t mask) { *addr |= mask; }
+
+typedef struct { volatile uint32_t csr, rvr, cvr, calib; } systick_hw_t;
+extern systick_hw_t *systick_hw;
+
+#define DMA_IRQ_0 11
+
+/* Queues of fixed size elements */
+#define HOST_QUEUE_BYTES 256
+
+typedef struct {
+        uint8_t data[HOST_QUEUE_BYTES];
+        uint element_size, capacity, head, count;
+} queue_t;
+
+void queue_init(queue_t *q, uint element_size, uint element_count);
+bool queue_try_add(queue_t *q, const void *data);
+bool queue_try_remove(queue_t *q, void *data);
+void queue_add_blocking(queue_t *q, const void *data);
+void queue_remove_blocking(queue_t *q, void *data);
+static inline uint queue_get_level(queue_t *q) { return q->count; }
+static inline bool queue_is_empty(queue_t *q) { return q->count == 0; }
+
+/* DMA: a channel runs to completion the moment it is triggered */
+#define DMA_SIZE_8 0
+#define DMA_SIZE_16 1
+#define DMA_SIZE_32 2
+#define HOST_DMA_CHANNELS 12
+
+typedef struct {
+        uint size;
+        bool read_increment, write_increment;
+        uint dreq;
+} dma_channel_config;
+
+struct host_dma_channel {
+        bool claimed;
+        dma_channel_config cfg;
+        volatile void *write_addr;
+        const volatile void *read_addr;
+        uint32_t count;
+};
+
+extern struct host_dma_channel host_dma[HOST_DMA_CHANNELS];
+
+int dma_claim_unused_channel(bool required);
+dma_channel_config dma_channel_get_default_config(uint chan);
+static inline void channel_config_set_transfer_data_size(dma_channel_config *c, int size) { c->size = size; }
+static inline void channel_config_set_read_increment(dma_channel_config *c, bool inc) { c->read_increment = inc; }
+static inline void channel_config_set_write_increment(dma_channel_config *c, bool inc) { c->write_increment = inc; }
+static inline void channel_config_set_dreq(dma_channel_config *c, uint dreq) { c->dreq = dreq; }
+void dma_channel_configure(uint chan, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint count, bool trigger);
+void dma_channel_set_read_addr(uint chan, const volatile void *read_addr, bool trigger);
+void dma_channel_set_write_addr(uint chan, volatile void *write_addr, bool trigger);
+void dma_channel_set_trans_count(uint chan, uint32_t count, bool trigger);
+void dma_channel_start(uint chan);
+void dma_start_channel_mask(uint32_t mask);
+static inline bool dma_channel_is_busy(uint chan) { (void)chan; return false; }
+static inline void dma_channel_wait_for_finish_blocking(uint chan) { (void)chan; }
+
+/* GPIO outputs only */
+extern bool host_gpio[30];
+static inline void gpio_put(uint gpio, bool value) { host_gpio[gpio] = value; }
+
+/* SPI: every byte clocked out goes to host_spi_device, which returns the
+ * byte clocked in.  A pair of DMA channels, one writing the data register
+ * and one reading it, started together, exchange bytes the same way.
+ */
+typedef struct { volatile uint32_t cr0, cr1, dr, sr, cpsr, imsc, ris, mis, icr, dmacr; } spi_hw_t;
+typedef struct spi_inst { spi_hw_t hw; uint baudrate; } spi_inst_t;
+
+extern spi_inst_t host_spi0;
+#define spi0 (&host_spi0)
+
+extern uint8_t (*host_spi_device)(uint8_t mosi);
+
+static inline spi_hw_t *spi_get_hw(spi_inst_t *spi) { return &spi->hw; }
+static inline uint spi_get_dreq(spi_inst_t *spi, bool is_tx) { (void)spi; return is_tx ? 16 : 17; }
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate);
+static inline uint spi_get_baudrate(const spi_inst_t *spi) { return spi->baudrate; }
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len);
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len);
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len);
+
+/* DVI: the test plays the part of the serialiser, pulling from q_tmds_valid */
+#define DVI_N_TMDS_BUFFERS 3
+#define DVI_DEFAULT_SERIAL_CONFIG 0
+
+struct dvi_timing {
+        uint32_t bit_clk_khz;
+        uint h_front_porch, h_sync_width, h_back_porch, h_active_pixels;
+        uint v_front_porch, v_sync_width, v_back_porch, v_active_lines;
+};
+
+extern const struct dvi_timing dvi_timing_640x480p_60hz;
+
+struct dvi_inst {
+        const struct dvi_timing *timing;
+        int ser_cfg;
+        void (*scanline_callback)(void);
+        queue_t q_tmds_valid, q_tmds_free;
+};
+
+void dvi_init(struct dvi_inst *inst, uint spinlock_tmds_queue, uint spinlock_colour_queue);
+static inline void dvi_register_irqs_this_core(struct dvi_inst *inst, int irq) { (void)inst; (void)irq; }
+static inline void dvi_start(struct dvi_inst *inst) { (void)inst; }
+
+/* libdvi's 1bpp encoder: pixel 0 is bit 0, two 10-bit symbols per word */
+void tmds_encode_1bpp(const uint32_t *pixbuf, uint32_t *symbuf, size_t n_pix);
+#define TMDS_SYMBOL_0 0x100u
+#define TMDS_SYMBOL_1 0x2ffu
+
+#endif
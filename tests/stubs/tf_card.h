@@ -0,0 +1,19 @@
+/* pico_fatfs's SPI configuration */
+
+#ifndef TF_CARD_H
+#define TF_CARD_H
+
+#include "pico_host.h"
+
+typedef struct {
+        spi_inst_t *spi_inst;
+        uint clk_slow, clk_fast;
+        uint pin_miso, pin_mosi, pin_sck, pin_cs;
+        bool pullup;
+} pico_fatfs_spi_config_t;
+
+#define CLK_SLOW_DEFAULT (100 * 1000)
+
+bool pico_fatfs_set_config(pico_fatfs_spi_config_t *config);
+
+#endif
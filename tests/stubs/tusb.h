@@ -0,0 +1,4 @@
+#include "pico_host.h"
+
+void tusb_init(void);
+void tuh_task(void);
@@ -0,0 +1,31 @@
+/* The parts of umac's interface the firmware uses */
+
+#ifndef UMAC_H
+#define UMAC_H
+
+#include <stdint.h>
+
+#define RAM_SIZE (208 * 1024)
+#define DISC_NUM_DRIVES 2
+
+typedef int (*disc_op_read)(void *ctx, uint8_t *data, unsigned int offset, unsigned int len);
+typedef int (*disc_op_write)(void *ctx, uint8_t *data, unsigned int offset, unsigned int len);
+
+typedef struct disc_descr {
+        uint8_t *base;
+        unsigned int size;
+        int read_only;
+        void *op_ctx;
+        disc_op_read op_read;
+        disc_op_write op_write;
+} disc_descr_t;
+
+int umac_init(void *ram_base, void *rom_base, disc_descr_t discs[DISC_NUM_DRIVES]);
+int umac_loop(void);
+void umac_mouse(int deltax, int deltay, int button);
+void umac_kbd_event(uint8_t scancode, int down);
+void umac_vsync_event(void);
+void umac_1hz_event(void);
+unsigned int umac_get_fb_offset(void);
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Minimal checks for the host tests: a failed CHECK reports and carries on,
+ * and test_exit() turns the tally into the process exit status for ctest.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)                                                        \
+        do {                                                                    \
+                if (!(cond)) {                                                  \
+                        test_failures++;                                        \
+                        fprintf(stderr, "%s:%d: CHECK(%s) failed: ",            \
+                                __FILE__, __LINE__, #cond);                     \
+                        fprintf(stderr, __VA_ARGS__);                           \
+                        fprintf(stderr, "\n");                                  \
+                }                                                               \
+        } while (0)
+
+static inline int test_exit(void)
+{
+        if (test_failures)
+                fprintf(stderr, "%d check(s) failed\n", test_failures);
+        return test_failures ? 1 : 0;
+}
+
+#endif
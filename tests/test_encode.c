@@ -0,0 +1,70 @@
+/*
+ * Mac line to TMDS encoders in src/video.c: the fused lookup used for
+ * scan-out must give exactly what the two stage table[] and
+ * tmds_encode_1bpp() path gives, for every byte value in every position.
+ * Both are then timed over the same lines.  The host tmds_encode_1bpp() is
+ * plain C rather than libdvi's assembler, so the ratio flatters the fused
+ * path; the RP2040 figures come from VIDEO_PROFILE.
+ */
+
+#include <time.h>
+
+#include "test.h"
+#include "../src/video.c"
+
+#define BENCH_LINES 20000
+
+static uint32_t lines[64][STRIDE / 4];
+
+static double now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+        static uint32_t expected[ACTIVE_WORDS], fused[ACTIVE_WORDS];
+        uint8_t line[STRIDE] __attribute__((aligned(4)));
+        uint32_t seed = 0x12345678;
+
+        init_mac_tmds_lut();
+
+        //Each byte value at each position: line n holds n + x at byte x
+        for (int n = 0; n < 256; n++) {
+                for (int x = 0; x < STRIDE; x++)
+                        line[x] = n + x;
+
+                encode_line_table(line, expected);
+                encode_line_lut(line, fused);
+                CHECK(memcmp(expected, fused, sizeof(expected)) == 0, "line %d", n);
+        }
+
+        for (int i = 0; i < 64; i++) {
+                for (int x = 0; x < STRIDE / 4; x++) {
+                        seed = seed * 1664525 + 1013904223;
+                        lines[i][x] = seed;
+                }
+
+                encode_line_table((const uint8_t *)lines[i], expected);
+                encode_line_lut((const uint8_t *)lines[i], fused);
+                CHECK(memcmp(expected, fused, sizeof(expected)) == 0, "random line %d", i);
+        }
+
+        double start = now_ns();
+        for (int i = 0; i < BENCH_LINES; i++)
+                encode_line_table((const uint8_t *)lines[i % 64], expected);
+        double table_ns = (now_ns() - start) / BENCH_LINES;
+
+        start = now_ns();
+        for (int i = 0; i < BENCH_LINES; i++)
+                encode_line_lut((const uint8_t *)lines[i % 64], fused);
+        double lut_ns = (now_ns() - start) / BENCH_LINES;
+
+        printf("encode: table %.0f ns/line, fused %s %.0f ns/line (%.1fx)\n",
+               table_ns, VIDEO_SCRATCH ? "nibble" : "byte", lut_ns, table_ns / lut_ns);
+
+        return test_exit();
+}
@@ -0,0 +1,116 @@
+/*
+ * Flushing the SD disc image (src/sd_disc.c) while the card refuses writes.
+ *
+ * A few sectors are left dirty, then the card starts failing every write
+ * and sync, as a pulled or worn-out card would.  sd_disc_poll() runs every
+ * millisecond, first with the disc idle and then with the Mac still reading,
+ * and each flush it tries is counted from the failed writes (one flush
+ * stops at its first).  Each path to a flush must be retried at most once
+ * per DISC_FLUSH_MS, since on a real card every try can block on write
+ * timeouts.  Writes that fill the dirty limit meanwhile must still succeed,
+ * since the cache holds them.  Once the card works again the next timed
+ * flush must get the data out.
+ */
+
+#include "test.h"
+#include "fakefs.h"
+#include "sdcard.h"
+#include "../src/sd_disc.c"
+
+#define IMAGE_BYTES     (256 * 1024)
+#define RUN_MS          5000
+
+static uint8_t mirror[IMAGE_BYTES];
+
+/* Poll once a millisecond for RUN_MS, reading cached sectors first if busy */
+static void run(const char *what, bool busy)
+{
+        uint32_t tries = 0, most = 0;
+        uint8_t buf[512];
+
+        for (int ms = 0; ms < RUN_MS; ms++) {
+                host_time_us += 1000;
+                if (busy)
+                        sd_disc_read(buf, (ms % 4) * 8192, sizeof(buf));
+
+                uint32_t before = fakefs_stats.failed_writes;
+
+                sd_disc_poll();
+
+                uint32_t n = fakefs_stats.failed_writes - before;
+
+                tries += n;
+                if (n > most)
+                        most = n;
+        }
+        printf("%s: %u flush tries in %u ms\n", what, tries, RUN_MS);
+        CHECK(most <= 1, "%s: a poll tried to flush %u times", what, most);
+        CHECK(tries >= 1 && tries <= RUN_MS / DISC_FLUSH_MS + 1,
+              "%s: %u flush tries, at most %u expected", what, tries, RUN_MS / DISC_FLUSH_MS + 1);
+        CHECK(sd_disc_unsaved(), "%s: failed flushes lost the unsaved state", what);
+}
+
+int main(void)
+{
+        static FATFS fs;
+        static FIL fp, check;
+        pico_fatfs_spi_config_t spi = { .spi_inst = spi0, .pin_cs = 21 };
+        UINT did_read;
+
+        fakefs_format(4096);
+        for (uint32_t i = 0; i < IMAGE_BYTES; i++)
+                mirror[i] = i * 7;
+        fakefs_create("/disc.img", mirror, IMAGE_BYTES);
+
+        sdcard_attach(spi.pin_cs);
+        spi_set_baudrate(spi0, 25 * 1000 * 1000);
+
+        CHECK(f_mount(&fs, "", 1) == FR_OK, "mount");
+        CHECK(f_open(&fp, "/disc.img", FA_OPEN_EXISTING | FA_READ | FA_WRITE) == FR_OK, "open");
+        sd_disc_open(&fp, &spi);
+        CHECK(disc_raw == EXPECT_RAW, "raw access %d, expected %d", disc_raw, EXPECT_RAW);
+
+        for (uint32_t s = 0; s < 4; s++) {
+                memset(mirror + s * 8192, 0xa0 + s, 512);
+                CHECK(sd_disc_write(mirror + s * 8192, s * 8192, 512) == 0, "write %u", s);
+        }
+        CHECK(dirty_count == 4, "%u sectors dirty, expected 4", dirty_count);
+
+        fakefs_fail_writes = true;
+        run("idle", false);
+        run("busy", true);
+
+        /* A write the cache doesn't take fails with the FatFs result */
+        static uint8_t big[2 * DISC_CACHE_FILL_MAX];
+
+        CHECK(sd_disc_write(big, 128 * 1024, sizeof(big)) != 0, "uncached write didn't fail");
+        CHECK(sd_disc_last_result() == FR_DISK_ERR, "failed write gave result %d", sd_disc_last_result());
+
+        /* Filling the dirty limit tries a write-back, but data the cache
+         * took isn't reported to the Mac as lost when that fails
+         */
+        for (uint32_t s = 4; s < DISC_DIRTY_MAX; s++) {
+                memset(mirror + s * 8192, 0xa0 + s, 512);
+                CHECK(sd_disc_write(mirror + s * 8192, s * 8192, 512) == 0,
+                      "cached write %u reported failed", s);
+        }
+        CHECK(dirty_count == DISC_DIRTY_MAX, "%u sectors dirty, expected %u", dirty_count, DISC_DIRTY_MAX);
+
+        fakefs_fail_writes = false;
+        host_time_us += DISC_FLUSH_MS * 1000;
+        sd_disc_poll();
+        CHECK(!sd_disc_unsaved(), "no flush once the card works again");
+        CHECK(sd_disc_write(big, 128 * 1024, sizeof(big)) == 0 && sd_disc_last_result() == FR_OK,
+              "write after recovery gave result %d", sd_disc_last_result());
+
+        CHECK(f_open(&check, "/disc.img", FA_READ) == FR_OK, "reopen");
+        for (uint32_t s = 0; s < DISC_DIRTY_MAX; s++) {
+                uint8_t buf[512];
+
+                f_lseek(&check, s * 8192);
+                f_read(&check, buf, sizeof(buf), &did_read);
+                CHECK(memcmp(buf, mirror + s * 8192, sizeof(buf)) == 0, "sector at %u not saved", s * 8192);
+        }
+
+        return test_exit();
+}
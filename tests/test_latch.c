@@ -0,0 +1,128 @@
+/*
+ * Vsync-latched scan-out (VIDEO_LATCH) on the host.
+ *
+ * A stand-in emulator redraws the whole framebuffer every emulated frame,
+ * filling every byte of frame n with n, two lines per scanline period so
+ * the drawing can overtake scan-out.  As in main.c its vsync follows the DVI
+ * vertical blank, after a delay that is usually short and now and then long
+ * enough to land in the picture.  With VIDEO_LATCH every frame shown must be
+ * the one latched last before the picture started; the same run without it
+ * reports how many frames tear.
+ */
+
+#include "test.h"
+#include "../src/video.c"
+
+static uint8_t __attribute__((aligned(4))) framebuffer[(VIDEO_FB_VRES + 1) * STRIDE];
+
+#define EMU_FRAMES 400
+
+static uint emu_frame = 0;
+static uint emu_line = VIDEO_FB_VRES;
+static int vsync_in = -1;
+static uint32_t last_vblank = 0;
+static int latched = -1;
+
+/* One scanline period of emulation: take the vsync if it's due, then draw */
+static void emulate_scanline(void)
+{
+        uint32_t vblank_us;
+        uint32_t vblank = video_get_vblank(&vblank_us);
+
+        if (vblank != last_vblank) {
+                last_vblank = vblank;
+                //Mostly prompt, sometimes late enough to miss the blank
+                vsync_in = emu_frame % 7 == 0 ? 150 : emu_frame % 30;
+        }
+
+        if (vsync_in >= 0 && vsync_in-- == 0) {
+#if VIDEO_LATCH
+                uint32_t skipped = latch_skipped;
+
+                video_latch_framebuffer();
+                if (latch_skipped == skipped)
+                        latched = emu_frame;
+#endif
+                emu_frame++;
+                emu_line = 0;
+        }
+
+        for (int i = 0; i < 2 && emu_line < VIDEO_FB_VRES; i++) {
+                memset(framebuffer + (emu_line + 1) * STRIDE, emu_frame, STRIDE);
+                emu_line++;
+        }
+}
+
+/* The Mac byte shown at the start of a line, decoded from its symbols */
+static uint8_t decode_first_byte(const uint32_t *tmdsbuf)
+{
+        const uint32_t *active = tmdsbuf + BORDER_WORDS;
+        uint8_t byte = 0;
+
+        for (int px = 0; px < 8; px++) {
+                uint32_t sym = (active[px / 2] >> (10 * (px % 2))) & 0x3ff;
+
+                byte = (byte << 1) | (sym == TMDS_SYMBOL_0);
+        }
+
+        return byte;
+}
+
+int main(void)
+{
+        uint32_t *tmdsbuf;
+        int torn = 0, wrong = 0, frames = 0;
+
+        video_init();
+        queue_remove_blocking(&dvi0.q_tmds_valid, &tmdsbuf);
+        queue_add_blocking(&dvi0.q_tmds_free, &tmdsbuf);
+
+        set_framebuffer(framebuffer);
+
+        while (emu_frame < EMU_FRAMES) {
+                int first = -1, expected = -1;
+                bool mixed = false;
+
+                for (uint y = 0; y < FRAME_HEIGHT; y++) {
+                        if (y == FIRST_LINE + 1)
+                                expected = latched;
+
+                        scanline_callback();
+                        queue_remove_blocking(&dvi0.q_tmds_valid, &tmdsbuf);
+
+                        if (y > FIRST_LINE && y < LAST_LINE) {
+                                int shown = decode_first_byte(tmdsbuf);
+
+                                if (first < 0)
+                                        first = shown;
+                                else if (shown != first)
+                                        mixed = true;
+                        }
+
+                        queue_add_blocking(&dvi0.q_tmds_free, &tmdsbuf);
+                        emulate_scanline();
+                }
+
+                //Until the first latch, scan-out shows live RAM
+                if (VIDEO_LATCH && expected < 0)
+                        continue;
+                if (VIDEO_LATCH && first != (uint8_t)expected)
+                        wrong++;
+                frames++;
+                torn += mixed;
+        }
+
+#if VIDEO_LATCH
+        printf("latched: %d frames, %d torn, %d not the last latched, %u latches skipped\n",
+               frames, torn, wrong, latch_skipped);
+        CHECK(torn == 0, "%d torn frames", torn);
+        CHECK(wrong == 0, "%d frames not the last latched", wrong);
+        CHECK(latch_skipped > 0, "vsync never landed in the picture");
+#else
+        printf("live: %d frames, %d torn\n", frames, torn);
+        //Otherwise the latched run proves nothing
+        CHECK(torn > 0, "the emulator never tore a frame");
+#endif
+
+        return test_exit();
+}
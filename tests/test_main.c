@@ -0,0 +1,249 @@
+/*
+ * main.c's core1 loop on the host, against a modelled emulator.
+ *
+ * Time only moves when the model says so.  umac_loop() costs LOOP_US, with
+ * a STALL_US disc access every STALL_EVERY calls, and each housekeeping
+ * poll costs POLL_COST_US.  These are stand-ins, not RP2040 measurements:
+ * the test shows what the batching logic does with them, how much time goes
+ * to emulation and how long input and vsync wait, not the real speed-up,
+ * which EMU_STATS reports on hardware.
+ *
+ * Then the mouse moves in small steps, with hid.c's running totals past
+ * what a float holds exactly and across their wrap, and the Mac must be
+ * told every whole pixel of it.  Last, the F12 flush hotkey is pressed with
+ * the SD disc clean, dirty, and failing to write, checking what gets
+ * flushed and what's reported.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+/* The firmware's messages, to check what it reports */
+static char last_message[128];
+
+static int      log_printf(const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vsnprintf(last_message, sizeof(last_message), fmt, ap);
+        va_end(ap);
+        return fputs(last_message, stdout);
+}
+
+#define printf log_printf
+#define main firmware_main
+#include "../src/main.c"
+#undef main
+
+#define LOOP_US         12
+#define STALL_US        3000
+#define STALL_EVERY     4000
+#define POLL_COST_US    8
+#define FRAME_US        16667
+#define RUN_US          (2 * 1000 * 1000)
+
+/* Inputs main.c reads, normally from hid.c and kbd.c */
+volatile int32_t cursor_x = 0;
+volatile int32_t cursor_y = 0;
+volatile int cursor_button = 0;
+
+void hid_app_task(void) {}
+
+static uint16_t keys[8];
+static int n_keys = 0;
+
+bool kbd_queue_empty(void) { return n_keys == 0; }
+
+uint16_t kbd_queue_pop(void)
+{
+        uint16_t key = keys[0];
+
+        memmove(keys, keys + 1, --n_keys * sizeof(keys[0]));
+        return key;
+}
+
+static uint64_t loops = 0, emu_us = 0, polls = 0, stalls = 0;
+static uint64_t last_poll = 0, max_gap = 0;
+static uint32_t gaps_over_poll_us = 0;
+
+int umac_loop(void)
+{
+        uint32_t us = ++loops % STALL_EVERY ? LOOP_US : STALL_US;
+
+        stalls += us == STALL_US;
+        host_time_us += us;
+        emu_us += us;
+        return 0;
+}
+
+int m68k_cycles_run(void) { return LOOP_US * 8; }
+
+void tuh_task(void)
+{
+        uint64_t gap = host_time_us - last_poll;
+
+        if (polls++ > 0) {
+                if (gap > max_gap)
+                        max_gap = gap;
+                gaps_over_poll_us += gap > UMAC_POLL_US;
+        }
+        host_time_us += POLL_COST_US;
+        last_poll = host_time_us;
+}
+
+void tusb_init(void) {}
+
+/* Where the Mac thinks the mouse is, and the raw counts sent to get it there */
+static int64_t mac_mouse_x = 0, mac_mouse_y = 0;
+static int64_t counts_x = 0, counts_y = 0;
+
+void umac_mouse(int deltax, int deltay, int button)
+{
+        mac_mouse_x += deltax;
+        mac_mouse_y -= deltay;
+}
+static uint32_t mac_keys = 0;
+
+void umac_kbd_event(uint8_t scancode, int down) { mac_keys++; }
+void umac_vsync_event(void) {}
+void umac_1hz_event(void) {}
+int umac_init(void *ram_base, void *rom_base, disc_descr_t discs[DISC_NUM_DRIVES]) { return 0; }
+unsigned int umac_get_fb_offset(void) { return 0; }
+
+uint32_t video_get_vblank(uint32_t *time_us)
+{
+        uint32_t frame = host_time_us / FRAME_US;
+
+        *time_us = (uint32_t)frame * FRAME_US;
+        return frame;
+}
+
+void video_init(void) {}
+void set_framebuffer(uint8_t *framebuffer) {}
+void video_latch_framebuffer(void) {}
+void video_set_overlay(const char *text) {}
+void video_print_stats(void) {}
+void multicore_launch_core1(void (*entry)(void)) {}
+
+/* Disc and menu entry points; the loop only ever polls the disc */
+void init_menu(uint8_t *fb, FATFS *filesystem, uint8_t *index_arena, uint32_t index_size) {}
+bool process_menu(FIL *file) { return true; }
+bool pico_fatfs_set_config(pico_fatfs_spi_config_t *config) { return true; }
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt) { return FR_NOT_READY; }
+FRESULT f_mkdir(const TCHAR *path) { return FR_NOT_READY; }
+void sd_disc_open(FIL *fp, const pico_fatfs_spi_config_t *spi) {}
+void sd_disc_tune_clock(const pico_fatfs_spi_config_t *spi, uint8_t *scratch, unsigned int scratch_len) {}
+int sd_disc_read(uint8_t *data, unsigned int offset, unsigned int len) { return -1; }
+int sd_disc_write(uint8_t *data, unsigned int offset, unsigned int len) { return -1; }
+
+static bool disc_unsaved = false;
+static int flush_result = 0;
+static uint32_t flushes = 0;
+
+int sd_disc_flush(void)
+{
+        flushes++;
+        if (flush_result == 0)
+                disc_unsaved = false;
+        return flush_result;
+}
+
+bool sd_disc_unsaved(void) { return disc_unsaved; }
+void sd_disc_poll(void) {}
+void sd_disc_print_stats(void) {}
+int disc_packed_setup(disc_descr_t *disc, const uint8_t *packed, unsigned int packed_len) { return -1; }
+int disc_overlay_setup(disc_descr_t *disc, const char *path, FIL *fp,
+                       const pico_fatfs_spi_config_t *spi) { return -1; }
+void disc_trace_record(bool write, uint32_t offset, uint32_t len, uint32_t latency_us, int result) {}
+void disc_trace_dump(const char *path) {}
+
+/* A HID report, added to the running totals as hid.c does */
+static void     mouse_report(int32_t x, int32_t y)
+{
+        cursor_x = (int32_t)((uint32_t)cursor_x + x);
+        cursor_y = (int32_t)((uint32_t)cursor_y + y);
+        counts_x += x;
+        counts_y += y;
+        poll_umac();
+}
+
+static int64_t  floor_div(int64_t n, int64_t d)
+{
+        return n / d - (n % d < 0);
+}
+
+/* Reports of -4 to 4 counts, checking the Mac has every whole pixel */
+static bool     mouse_steps(int reports)
+{
+        bool ok = true;
+
+        for (int i = 0; i < reports; i++) {
+                mouse_report(i * 7 % 9 - 4, i * 5 % 9 - 4);
+                ok &= mac_mouse_x == floor_div(counts_x, MOUSE_DIVIDER) &&
+                      mac_mouse_y == floor_div(counts_y, MOUSE_DIVIDER);
+        }
+        return ok;
+}
+
+/* Press and release F12 with the disc in the given state */
+static void     press_f12(bool unsaved, int result)
+{
+        disc_unsaved = unsaved;
+        flush_result = result;
+        flushes = 0;
+        mac_keys = 0;
+        last_message[0] = 0;
+        keys[n_keys++] = 0x8000 | KBD_MAC_KEY(MKC_F12);
+        keys[n_keys++] = KBD_MAC_KEY(MKC_F12);
+        while (n_keys)
+                poll_umac();
+}
+
+int main(void)
+{
+        //The body of core1_main()'s loop
+        while (host_time_us < RUN_US) {
+                poll_umac();
+                poll_usb();
+                sd_disc_poll();
+        }
+
+        printf("quantum %s: %llu%% emulating, %llu loops/s, %llu polls/s, "
+               "max gap %llu us, %u gaps over %u us, vsync %u late %u missed (%llu stalls)\n",
+               UMAC_LOOP_QUANTUM ? "fixed" : "tuned", emu_us * 100 / host_time_us,
+               loops * 1000000 / host_time_us, polls * 1000000 / host_time_us,
+               max_gap, gaps_over_poll_us, UMAC_POLL_US, vsync_late, vsync_missed, stalls);
+
+        //A stall holds up the next poll however batches are sized
+        CHECK(max_gap < STALL_US + UMAC_LOOP_QUANTUM_MAX * LOOP_US, "max gap %llu us", max_gap);
+        CHECK(vsync_missed == 0, "%u vsyncs missed", vsync_missed);
+#if UMAC_LOOP_QUANTUM == 0
+        //Batches settle just under UMAC_POLL_US and shrink after a stall
+        CHECK(emu_us * 100 / host_time_us >= 95, "emulating %llu%%", emu_us * 100 / host_time_us);
+        CHECK(gaps_over_poll_us <= stalls * 2, "%u gaps over UMAC_POLL_US", gaps_over_poll_us);
+        CHECK(vsync_late <= stalls, "%u vsyncs late", vsync_late);
+#endif
+
+        CHECK(mouse_steps(1000), "small moves lost");
+        mouse_report(1 << 26, -(1 << 26));
+        CHECK(mouse_steps(1000), "small moves lost past float precision");
+        mouse_report(INT32_MAX, INT32_MIN + 1);
+        CHECK(mouse_steps(1000), "small moves lost across the wrap");
+
+        press_f12(false, 0);
+        CHECK(flushes == 0 && last_message[0] == 0, "clean disc: %u flushes, \"%s\"",
+              flushes, last_message);
+        press_f12(true, 0);
+        CHECK(flushes == 1 && strstr(last_message, "flushed"), "dirty disc: %u flushes, \"%s\"",
+              flushes, last_message);
+        press_f12(true, -1);
+        CHECK(flushes == 1 && strstr(last_message, "failed"), "failing disc: %u flushes, \"%s\"",
+              flushes, last_message);
+        CHECK(mac_keys == 0, "F12 reached the Mac %u times", mac_keys);
+
+        return test_exit();
+}
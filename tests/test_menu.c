@@ -0,0 +1,248 @@
+/*
+ * The image selector (src/menu.c) on the host, over a fakefs card with a
+ * few thousand images in the root folder.
+ *
+ * With catalogs, the first page must be drawn without reading the folder
+ * at all once a catalog exists, the idle rescan must find and fix a
+ * catalog that's out of date, and Enter must act on the folder as it is
+ * now.  Without them, the first page comes after a full scan.  Either way
+ * the framebuffer must show exactly the text the menu meant to draw, which
+ * checks the changed-cells renderer against the font drawn the slow way.
+ * Last, picking the flash image with Esc must be remembered, and the next
+ * boot must count down to it, from when the menu is shown rather than
+ * from before a slow first scan.
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "fakefs.h"
+#include "umac.h"
+#include "../src/menu.c"
+#include "font_8x8.h"
+
+#define IMAGES          3000
+#define CARD_SECTORS    (FAKEFS_DATA_START + (IMAGES + 512) * FAKEFS_CLUSTER_SECTORS)
+#define PRESS(mkc)      (0x8000 | KBD_MAC_KEY(mkc))
+
+static uint8_t ram[RAM_SIZE];
+static uint16_t keys[16];
+static int n_keys;
+
+bool            kbd_queue_empty()
+{
+        return n_keys == 0;
+}
+
+uint16_t        kbd_queue_pop()
+{
+        uint16_t key;
+
+        if (n_keys == 0)
+                return 0;
+        key = keys[0];
+        memmove(keys, keys + 1, --n_keys * sizeof(keys[0]));
+        return key;
+}
+
+static void     press(uint8_t mkc)
+{
+        keys[n_keys++] = PRESS(mkc);
+}
+
+static void     start(void)
+{
+        init_menu(ram, NULL, ram + MENU_FB_BYTES, sizeof(ram) - MENU_FB_BYTES);
+}
+
+/* Idle polls until the rescan is done */
+static uint32_t settle(FIL *fp)
+{
+        uint32_t polls = 0;
+
+        while (verifying && polls < 10 * IMAGES) {
+                process_menu(fp);
+                polls++;
+        }
+        return polls;
+}
+
+/* Cells whose pixels aren't the glyph of the text there, drawn straight
+ * from font_8x8.h (rows of every glyph in turn, LSB leftmost)
+ */
+static uint32_t bad_cells(void)
+{
+        uint32_t bad = 0;
+
+        for (int y = 0; y < ROWS; y++) {
+                for (int x = 0; x < COLS; x++) {
+                        uint8_t ch = (uint8_t)text[y * COLS + x] - FONT_FIRST_ASCII;
+                        bool ok = true;
+
+                        if (ch >= FONT_N_CHARS)
+                                ch = '?' - FONT_FIRST_ASCII;
+                        for (int i = 0; i < 9; i++) {
+                                uint8_t row = i < FONT_CHAR_HEIGHT ? font_8x8[i * FONT_N_CHARS + ch] : 0;
+                                uint8_t want = 0;
+
+                                for (int b = 0; b < 8; b++)
+                                        want |= ((row >> b) & 1) << (7 - b);
+                                ok &= ram[(y * 9 + i) * STRIDE + x] == want;
+                        }
+                        bad += !ok;
+                }
+        }
+        return bad;
+}
+
+static bool     shown(const char *name)
+{
+        for (uint32_t i = 0; i < view_entries; i++)
+                if (strcmp(get_view_entry(i)->name, name) == 0)
+                        return true;
+        return false;
+}
+
+int main(void)
+{
+        static FATFS fs;
+        static FIL fp;
+        char name[32];
+
+        fakefs_format(CARD_SECTORS);
+        CHECK(f_mount(&fs, "", 1) == FR_OK, "mount");
+        f_mkdir(SD_STATE_DIR);
+        for (int i = 0; i < IMAGES; i++) {
+                sprintf(name, "/image_%04d.dsk", (i * 7919) % IMAGES);
+                fakefs_create(name, NULL, i + 1);
+        }
+        f_mkdir("/System Folder");
+
+        /* First boot: scan, sort, and save a catalog */
+        fakefs_stats.dir_reads = 0;
+        start();
+        uint32_t cold = fakefs_stats.dir_reads;
+
+        CHECK(view_entries == IMAGES + 1, "%u entries listed", view_entries);
+        CHECK(get_view_entry(0)->is_folder && strcmp(get_view_entry(0)->name, "System Folder") == 0,
+              "folders first");
+        CHECK(strcmp(get_view_entry(1)->name, "image_0000.dsk") == 0 &&
+              strcmp(get_view_entry(IMAGES)->name, "image_2999.dsk") == 0, "sorted");
+        CHECK(cold > IMAGES, "first scan read %u entries", cold);
+        CHECK(bad_cells() == 0, "%u cells drawn wrong", bad_cells());
+
+        /* Next boot: the first page comes straight from the catalog */
+        fakefs_stats.dir_reads = 0;
+        start();
+        uint32_t warm = fakefs_stats.dir_reads;
+
+#if MENU_CATALOG
+        CHECK(warm == 0, "%u directory reads before the first page", warm);
+        uint32_t polls = settle(&fp);
+        CHECK(polls > IMAGES && fakefs_stats.dir_reads > IMAGES, "rescan took %u polls", polls);
+#else
+        CHECK(warm > IMAGES, "%u directory reads before the first page", warm);
+#endif
+        CHECK(view_entries == IMAGES + 1 && strcmp(get_view_entry(1)->name, "image_0000.dsk") == 0,
+              "catalog listing");
+        CHECK(bad_cells() == 0, "%u cells drawn wrong", bad_cells());
+        printf("%u images: first page after %u directory reads on first boot, %u on the next\n",
+               IMAGES, cold, warm);
+
+        /* Paging and moving the marker redraw just what changed */
+        press(MKC_Right);
+        press(MKC_Down);
+        press(MKC_Down);
+        while (n_keys)
+                process_menu(&fp);
+        CHECK(current_page == 1 && current_entry == 2, "page %u entry %u", current_page, current_entry);
+        CHECK(bad_cells() == 0, "%u cells drawn wrong after paging", bad_cells());
+
+        /* The folder changes behind the catalog's back */
+        f_unlink("/image_0000.dsk");
+        fakefs_create("/image_new.dsk", NULL, 1);
+        start();
+        CHECK(shown("image_0000.dsk") == (MENU_CATALOG != 0), "stale catalog shown first");
+        settle(&fp);
+        CHECK(!shown("image_0000.dsk") && shown("image_new.dsk"), "rescan updated the listing");
+        CHECK(bad_cells() == 0, "%u cells drawn wrong after the rescan", bad_cells());
+
+        start();
+        CHECK(!shown("image_0000.dsk") && shown("image_new.dsk"), "updated catalog saved");
+
+        /* Enter on a stale catalog rescans first rather than open a file that's gone */
+        f_unlink("/image_0001.dsk");
+        start();
+        for (const char *c = "0001"; *c; c++)
+                press(*c == '0' ? MKC_0 : MKC_1);
+        press(MKC_Down);
+        press(MKC_Enter);
+        bool picked = false;
+
+        while (n_keys)
+                picked |= process_menu(&fp);
+        CHECK(!picked, "opened an image that's gone");
+        CHECK(!verifying && !shown("image_0001.dsk"), "listing rescanned before acting");
+        CHECK(bad_cells() == 0, "%u cells drawn wrong after filtering", bad_cells());
+
+#if MENU_CATALOG
+        /* A corrupt catalog is ignored: sizes that would wrap on the RP2040,
+         * names running off the end of the records, and records that don't
+         * add up to the header's counts (data is bytes of fill)
+         */
+        static const struct { uint32_t entries, bytes; uint8_t fill; } corrupt[] = {
+                { 0x20000001, 0, 0 }, { 1, 0xfffffffc, 0 }, { 0, 0xffffffff, 0 },
+                { 1, 32, 'A' }, { 2, 16, 'A' }, { 1, 32, 0 }, { 3, 32, 0 },
+        };
+        static uint8_t records[32];
+
+        for (int i = 0; i < sizeof(corrupt) / sizeof(corrupt[0]); i++) {
+                UINT did_write;
+
+                memset(&catalog_header, 0, sizeof(catalog_header));
+                catalog_header.magic = MENU_CATALOG_MAGIC;
+                catalog_header.entries = corrupt[i].entries;
+                catalog_header.bytes = corrupt[i].bytes;
+                strcpy(catalog_header.path, current_path);
+                memset(records, corrupt[i].fill, sizeof(records));
+                catalog_name(current_path, name);
+                CHECK(f_open(&fp, name, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK, "open catalog");
+                f_write(&fp, &catalog_header, sizeof(catalog_header), &did_write);
+                if (corrupt[i].bytes <= sizeof(records))
+                        f_write(&fp, records, corrupt[i].bytes, &did_write);
+                f_close(&fp);
+
+                fakefs_stats.dir_reads = 0;
+                start();
+                CHECK(fakefs_stats.dir_reads > IMAGES && view_entries == IMAGES,
+                      "corrupt catalog %d: %u directory reads, %u entries", i,
+                      fakefs_stats.dir_reads, view_entries);
+        }
+#endif
+
+#if MENU_AUTOBOOT_S
+        /* Esc picks the flash image, and the next boot counts down to it */
+        press(MKC_Escape);
+        while (n_keys)
+                process_menu(&fp);
+        start();
+        CHECK(autoboot && strcmp(last_path, MENU_LAST_FLASH) == 0, "flash image not remembered");
+        host_time_us += (MENU_AUTOBOOT_S + 1) * 1000000ull;
+        fp.err = 0;
+        CHECK(process_menu(&fp) && fp.err == 0xFF, "didn't boot the flash image");
+
+        /* A first scan longer than the countdown doesn't use it up */
+#if MENU_CATALOG
+        catalog_name(current_path, name);
+        f_unlink(name);
+#endif
+        fakefs_readdir_us = 2 * MENU_AUTOBOOT_S * 1000000 / IMAGES;
+        start();
+        fakefs_readdir_us = 0;
+        CHECK(autoboot && !process_menu(&fp), "booted before the menu was shown");
+        host_time_us += (MENU_AUTOBOOT_S + 1) * 1000000ull;
+        CHECK(process_menu(&fp), "didn't boot after the countdown");
+#endif
+
+        return test_exit();
+}
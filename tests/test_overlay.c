@@ -0,0 +1,186 @@
+/*
+ * Copy-on-write overlay disc (src/disc_overlay.c) on the host.
+ *
+ * A read-only base image in RAM is overlaid with a delta file on a fake
+ * card, through sd_disc.c and the SD card model.  A random mix of reads
+ * and writes, aligned and not, is mirrored into a RAM copy and every read
+ * must match it.  Then:
+ *
+ *   - reopening the delta file after a flush gives the same disc;
+ *   - whenever a bitmap block lands on the card, the sectors it newly
+ *     claims are already written there, so a power cut at any point never
+ *     exposes unwritten (zeroed) space;
+ *   - a delta file for a different base is set aside, not applied;
+ *   - one that can't be read is left as it is, never recreated.
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "fakefs.h"
+#include "sdcard.h"
+#include "../src/disc_overlay.c"
+
+#define BASE_BYTES      (1024 * 1024)
+#define CARD_SECTORS    12288   /* fakefs never reuses clusters */
+#define REQUESTS        10000
+#define DELTA_PATH      "/disc0.cow"
+
+static uint8_t base[BASE_BYTES];
+static uint8_t mirror[BASE_BYTES];
+static uint8_t buf[16 * 1024];
+static uint32_t seed = 1;
+
+static FIL fp;
+static const pico_fatfs_spi_config_t spi = { .spi_inst = spi0, .pin_cs = 21 };
+
+static uint32_t next_random(void)
+{
+        seed = seed * 1664525 + 1013904223;
+        return seed >> 8;
+}
+
+static void pick(uint32_t *offset, uint32_t *len)
+{
+        static const uint32_t sizes[] = { 512, 512, 1024, 2048, 4096, 16384 };
+
+        *len = sizes[next_random() % 6];
+        if (next_random() % 4 == 0)
+                *len = next_random() % 1500 + 1;
+        if (next_random() % 4 == 0)
+                *offset = next_random() % (BASE_BYTES - *len);
+        else
+                *offset = (next_random() % (BASE_BYTES / 512)) * 512;
+        if (*offset + *len > BASE_BYTES)
+                *offset = BASE_BYTES - *len;
+}
+
+/* Overlay the base afresh, as the firmware does at boot */
+static int      setup(disc_descr_t *disc)
+{
+        *disc = (disc_descr_t){ .base = base, .size = BASE_BYTES, .read_only = 1 };
+        return disc_overlay_setup(disc, DELTA_PATH, &fp, &spi);
+}
+
+static bool     matches(disc_descr_t *disc, const uint8_t *expect)
+{
+        for (uint32_t offset = 0; offset < BASE_BYTES; offset += sizeof(buf)) {
+                if (disc->op_read(disc->op_ctx, buf, offset, sizeof(buf)) != 0 ||
+                    memcmp(buf, expect + offset, sizeof(buf)) != 0)
+                        return false;
+        }
+        return true;
+}
+
+static uint8_t card_bitmap[BASE_BYTES / SECTOR / 8];
+static uint32_t unwritten_claims = 0;
+
+static const uint8_t *on_card(uint32_t offset)
+{
+        return fakefs_card + fakefs_lba(DELTA_PATH, offset) * FAKEFS_SECTOR;
+}
+
+/* Every block the card takes: if it's the bitmap, the sectors it newly
+ * claims must already hold data
+ */
+static void     block_written(uint32_t lba)
+{
+        static const uint8_t zeros[SECTOR];
+        const uint8_t *now = on_card(SECTOR);
+
+        if (lba != fakefs_lba(DELTA_PATH, SECTOR))
+                return;
+        for (uint32_t s = 0; s < BASE_BYTES / SECTOR; s++) {
+                uint8_t bit = 1 << (s % 8);
+
+                if ((now[s / 8] & bit) && !(card_bitmap[s / 8] & bit) &&
+                    memcmp(on_card(data_offset + s * SECTOR), zeros, SECTOR) == 0)
+                        unwritten_claims++;
+        }
+        memcpy(card_bitmap, now, sizeof(card_bitmap));
+}
+
+int main(void)
+{
+        static FATFS fs;
+        disc_descr_t disc;
+        uint32_t reads = 0, writes = 0;
+        int bad_reads = 0;
+
+        for (uint32_t i = 0; i < BASE_BYTES; i++)
+                base[i] = next_random();
+        memcpy(mirror, base, BASE_BYTES);
+
+        fakefs_format(CARD_SECTORS);
+        sdcard_attach(spi.pin_cs);
+        spi_set_baudrate(spi0, 25 * 1000 * 1000);
+        CHECK(f_mount(&fs, "", 1) == FR_OK, "mount");
+
+        CHECK(setup(&disc) == 0, "create");
+        CHECK(disc.op_read != NULL && disc.op_write != NULL && !disc.read_only, "ops");
+        CHECK(matches(&disc, base), "fresh overlay differs from the base");
+        sdcard_written = block_written;
+
+        for (int i = 0; i < REQUESTS; i++) {
+                uint32_t offset, len;
+
+                pick(&offset, &len);
+                if (next_random() % 10 < 6) {
+                        memset(buf, 0x5a, len);
+                        CHECK(disc.op_read(disc.op_ctx, buf, offset, len) == 0, "read %u+%u", offset, len);
+                        if (memcmp(buf, mirror + offset, len) != 0)
+                                bad_reads++;
+                        reads++;
+                } else {
+                        for (uint32_t b = 0; b < len; b++)
+                                buf[b] = next_random();
+                        memcpy(mirror + offset, buf, len);
+                        CHECK(disc.op_write(disc.op_ctx, buf, offset, len) == 0, "write %u+%u", offset, len);
+                        writes++;
+                }
+
+                host_time_us += next_random() % 50 == 0 ? 200000 : next_random() % 2000;
+                sd_disc_poll();
+        }
+        CHECK(bad_reads == 0, "%d reads didn't match", bad_reads);
+        CHECK(unwritten_claims == 0, "%u sectors claimed on the card before being written",
+              unwritten_claims);
+        CHECK(disc.op_read(disc.op_ctx, buf, BASE_BYTES - 512, 1024) != 0, "read past the end");
+        CHECK(sd_disc_flush() == 0, "flush");
+        printf("%u reads %u writes\n", reads, writes);
+        f_close(&fp);
+
+        /* Reopened, the deltas are all there */
+        CHECK(setup(&disc) == 0, "reopen");
+        CHECK(matches(&disc, mirror), "reopened overlay differs");
+        f_close(&fp);
+
+        /* A reflashed base starts a new overlay, keeping the old one aside */
+        base[12345] ^= 1;
+        CHECK(setup(&disc) == 0, "new base");
+        CHECK(matches(&disc, base), "delta applied to a different base");
+        f_close(&fp);
+        CHECK(f_open(&fp, DELTA_PATH ".old", FA_READ) == FR_OK && f_size(&fp) == data_offset + BASE_BYTES,
+              "old overlay not kept");
+        f_close(&fp);
+
+        /* One that can't be used is left as it is, and the disc stays read-only */
+        static uint8_t header[SECTOR];
+        uint8_t *card_header = (uint8_t *)on_card(0);
+
+        memcpy(header, card_header, SECTOR);
+        card_header[0] ^= 0xff;
+        CHECK(setup(&disc) != 0 && disc.read_only && disc.base == base, "corrupt overlay used");
+        card_header[0] ^= 0xff;
+        CHECK(memcmp(card_header, header, SECTOR) == 0 && fakefs_lba(DELTA_PATH, 0) != 0,
+              "corrupt overlay rewritten");
+        CHECK(setup(&disc) == 0 && matches(&disc, base), "overlay lost after a failed open");
+        f_close(&fp);
+
+        f_mkdir("/dir.cow");
+        disc = (disc_descr_t){ .base = base, .size = BASE_BYTES, .read_only = 1 };
+        CHECK(disc_overlay_setup(&disc, "/dir.cow", &fp, &spi) != 0 && disc.read_only,
+              "overlay over a folder");
+
+        return test_exit();
+}
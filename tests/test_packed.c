@@ -0,0 +1,147 @@
+/*
+ * Packed in-flash disc images (src/disc_packed.c) on the host.
+ *
+ * The build packs an image from make_disc.py with tools/pack_disc.py, so
+ * this checks the packer and the decoder agree: whole, partial and
+ * chunk-straddling reads must all match the raw image.  Then the table is
+ * damaged in the ways a bad image could be (offsets going backwards, a
+ * chunk longer packed than unpacked, running off the blob, a truncated
+ * blob, a chunk size too big to shift) and setup must refuse each one,
+ * and a corrupt LZ4 chunk must fail its read rather than return garbage.
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "../src/disc_packed.c"
+
+static const uint8_t packed[] = {
+#include "disc_packed.inc"
+};
+
+static uint8_t image[64 * 1024];
+static uint32_t image_len;
+static uint8_t damaged[sizeof(packed)];
+static uint8_t buf[3 * DISC_PACKED_CHUNK];
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+        seed = seed * 1664525 + 1013904223;
+        return seed >> 8;
+}
+
+static void     put32(uint8_t *p, uint32_t v)
+{
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
+}
+
+static uint8_t *table_entry(uint32_t i)
+{
+        return damaged + PACKED_HEADER + i * 4;
+}
+
+/* Setup on a copy of the image after fix has damaged it */
+static int      setup_damaged(void (*fix)(void), unsigned int len)
+{
+        disc_descr_t disc = { 0 };
+
+        memcpy(damaged, packed, sizeof(packed));
+        fix();
+        return disc_packed_setup(&disc, damaged, len);
+}
+
+static void     backwards(void)
+{
+        put32(table_entry(2), get32(table_entry(1)) - 1);
+}
+
+/* The first two chunks are random, so stored raw and full length */
+static void     too_long(void)
+{
+        put32(table_entry(1), get32(table_entry(1)) + 1);
+}
+
+static void     off_the_end(void)
+{
+        uint32_t n = get32(damaged + 12);
+
+        put32(table_entry(n), get32(table_entry(n)) + 1);
+}
+
+static void     huge_count(void)
+{
+        put32(damaged + 8, 0xfffff000);
+        put32(damaged + 12, 0xfffff000 / DISC_PACKED_CHUNK);
+}
+
+static void     huge_shift(void)
+{
+        damaged[5] = 40;
+}
+
+static void     intact(void)
+{
+}
+
+int main(void)
+{
+        disc_descr_t disc = { 0 };
+        FILE *f = fopen(DISC_IMAGE, "rb");
+
+        CHECK(f != NULL, "open %s", DISC_IMAGE);
+        if (f == NULL)
+                return test_exit();
+        image_len = fread(image, 1, sizeof(image), f);
+        fclose(f);
+
+        CHECK(disc_packed_setup(&disc, packed, sizeof(packed)) == 0, "setup");
+        CHECK(disc.size == image_len, "size %u, expected %u", disc.size, image_len);
+        CHECK(disc.read_only && disc.op_write(NULL, buf, 0, 512) != 0, "read-only");
+
+        /* Every chunk whole, then random spans across them */
+        for (uint32_t offset = 0; offset < image_len; offset += DISC_PACKED_CHUNK) {
+                uint32_t len = image_len - offset < DISC_PACKED_CHUNK ? image_len - offset : DISC_PACKED_CHUNK;
+
+                CHECK(disc.op_read(NULL, buf, offset, len) == 0 &&
+                      memcmp(buf, image + offset, len) == 0, "chunk at %u", offset);
+        }
+        for (int i = 0; i < 2000; i++) {
+                uint32_t len = next_random() % sizeof(buf) + 1;
+                uint32_t offset;
+
+                if (len > image_len)
+                        len = image_len;
+                offset = next_random() % (image_len - len + 1);
+                memset(buf, 0x5a, len);
+                CHECK(disc.op_read(NULL, buf, offset, len) == 0 &&
+                      memcmp(buf, image + offset, len) == 0, "read %u+%u", offset, len);
+        }
+        CHECK(disc.op_read(NULL, buf, image_len - 1, 2) != 0, "read past the end");
+
+        CHECK(setup_damaged(intact, sizeof(packed)) == 0, "intact copy");
+        CHECK(setup_damaged(backwards, sizeof(packed)) != 0, "offsets going backwards");
+        CHECK(setup_damaged(too_long, sizeof(packed)) != 0, "chunk longer than unpacked");
+        CHECK(setup_damaged(off_the_end, sizeof(packed)) != 0, "last chunk off the end");
+        CHECK(setup_damaged(intact, sizeof(packed) - 1) != 0, "truncated data");
+        CHECK(setup_damaged(intact, PACKED_HEADER + 8) != 0, "truncated table");
+        CHECK(setup_damaged(huge_count, sizeof(packed)) != 0, "table bigger than the blob");
+        CHECK(setup_damaged(huge_shift, sizeof(packed)) != 0, "chunk size past 32 bits");
+
+        /* A compressed chunk that doesn't decode: the table's fine, the read isn't */
+        uint32_t chunk = 4;     /* Text, so LZ4 */
+        uint32_t data = PACKED_HEADER + (get32(packed + 12) + 1) * 4;
+        uint32_t start = data + get32(packed + PACKED_HEADER + chunk * 4);
+        uint32_t end = data + get32(packed + PACKED_HEADER + (chunk + 1) * 4);
+
+        CHECK(end - start > 0 && end - start < DISC_PACKED_CHUNK, "chunk %u isn't LZ4", chunk);
+        memcpy(damaged, packed, sizeof(packed));
+        memset(damaged + start, 0xff, end - start);
+        CHECK(disc_packed_setup(&disc, damaged, sizeof(damaged)) == 0, "setup, bad chunk");
+        CHECK(disc.op_read(NULL, buf, chunk * DISC_PACKED_CHUNK, 512) != 0, "corrupt chunk read");
+
+        return test_exit();
+}
@@ -0,0 +1,129 @@
+/*
+ * SD disc image access (src/sd_disc.c) on the host.
+ *
+ * A random mix of reads and writes, aligned and not, small and large,
+ * sequential and scattered, goes through sd_disc_read()/sd_disc_write()
+ * with idle time in between, mirrored into a RAM copy.  Every read must
+ * match the copy, and after a flush the image on the card must too.  Built
+ * once per access path (FatFs without fast seek, FatFs with it, raw LBA
+ * through disk_read(), DMA through sd_spi.c), each run checks it got the
+ * path it expects and reports how many card commands the workload took.
+ * DMA transfers go byte by byte through a model SD card (sdcard.c).
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "fakefs.h"
+#include "sdcard.h"
+#include "../src/sd_disc.c"
+
+#define IMAGE_BYTES     (2 * 1024 * 1024)
+#define REQUESTS        20000
+
+#ifndef FRAGMENTED
+#define FRAGMENTED      0
+#endif
+
+static uint8_t mirror[IMAGE_BYTES];
+static uint8_t buf[64 * 1024];
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+        seed = seed * 1664525 + 1013904223;
+        return seed >> 8;
+}
+
+/* Mostly sector-sized and aligned, as the Mac's driver does, with some
+ * odd ones; the length of a "sequential" request follows the last one.
+ */
+static void pick(uint32_t *offset, uint32_t *len, uint32_t last_end)
+{
+        static const uint32_t sizes[] = { 512, 512, 1024, 2048, 4096, 8192, 32768, 65536 };
+        uint32_t r = next_random() % 100;
+
+        *len = sizes[next_random() % 8];
+        if (r < 10)
+                *len = next_random() % 1500 + 1;
+
+        if (r < 30 && last_end + *len <= IMAGE_BYTES)
+                *offset = last_end;
+        else if (r < 40)
+                *offset = next_random() % (IMAGE_BYTES - *len);
+        else
+                *offset = (next_random() % (IMAGE_BYTES / 512)) * 512;
+
+        if (*offset + *len > IMAGE_BYTES)
+                *offset = IMAGE_BYTES - *len;
+}
+
+int main(void)
+{
+        static FATFS fs;
+        static FIL fp, check;
+        pico_fatfs_spi_config_t spi = { .spi_inst = spi0, .pin_cs = 21 };
+        uint32_t last_end = 0, reads = 0, writes = 0;
+        int bad_reads = 0;
+
+        fakefs_format(16384);
+        fakefs_fragment = FRAGMENTED;
+        for (uint32_t i = 0; i < IMAGE_BYTES; i++)
+                mirror[i] = next_random();
+        fakefs_create("/disc.img", mirror, IMAGE_BYTES);
+        fakefs_fragment = false;
+
+        sdcard_attach(spi.pin_cs);
+        spi_set_baudrate(spi0, 25 * 1000 * 1000);
+
+        CHECK(f_mount(&fs, "", 1) == FR_OK, "mount");
+        CHECK(f_open(&fp, "/disc.img", FA_OPEN_EXISTING | FA_READ | FA_WRITE) == FR_OK, "open");
+        sd_disc_open(&fp, &spi);
+
+        CHECK(disc_raw == EXPECT_RAW, "raw access %d, expected %d", disc_raw, EXPECT_RAW);
+        CHECK(disc_spi == EXPECT_SPI, "DMA access %d, expected %d", disc_spi, EXPECT_SPI);
+        memset(&fakefs_stats, 0, sizeof(fakefs_stats));
+
+        for (int i = 0; i < REQUESTS; i++) {
+                uint32_t offset, len;
+
+                pick(&offset, &len, last_end);
+                last_end = offset + len;
+
+                if (next_random() % 10 < 6) {
+                        memset(buf, 0x5a, len);
+                        CHECK(sd_disc_read(buf, offset, len) == 0, "read %u+%u", offset, len);
+                        if (memcmp(buf, mirror + offset, len) != 0)
+                                bad_reads++;
+                        reads++;
+                } else {
+                        for (uint32_t b = 0; b < len; b++)
+                                buf[b] = next_random();
+                        memcpy(mirror + offset, buf, len);
+                        CHECK(sd_disc_write(buf, offset, len) == 0, "write %u+%u", offset, len);
+                        writes++;
+                }
+
+                //Mostly back to back, now and then long enough to flush
+                host_time_us += next_random() % 50 == 0 ? 200000 : next_random() % 2000;
+                sd_disc_poll();
+        }
+        CHECK(bad_reads == 0, "%d reads didn't match", bad_reads);
+        CHECK(sd_disc_flush() == 0 && !sd_disc_unsaved(), "flush");
+
+        uint32_t commands = fakefs_stats.commands + sdcard_stats.commands;
+
+        printf("%s: %u reads %u writes, %u card commands (%u FAT lookups), %u syncs\n",
+               access_path(), reads, writes, commands, fakefs_stats.fat_reads, fakefs_stats.syncs);
+        sd_disc_print_stats();
+
+        CHECK(f_open(&check, "/disc.img", FA_READ) == FR_OK, "reopen");
+        for (uint32_t offset = 0; offset < IMAGE_BYTES; offset += sizeof(buf)) {
+                UINT did_read;
+
+                f_read(&check, buf, sizeof(buf), &did_read);
+                CHECK(memcmp(buf, mirror + offset, sizeof(buf)) == 0, "image differs at %u", offset);
+        }
+
+        return test_exit();
+}
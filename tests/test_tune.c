@@ -0,0 +1,92 @@
+/*
+ * SD clock tuning (sd_disc_tune_clock() in src/sd_disc.c) on the host.
+ *
+ * The model SD card garbles transfers above set read and write rates.
+ * Tuning must pick a rate no faster than either, since the disc image is
+ * written at it too, and must not touch the RAM it wasn't given.  The
+ * rate is cached on the card and reused, without writing to the card,
+ * while test reads still pass, and tuned again once they don't.  The
+ * scratch file writes are tested in is gone afterwards.
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "fakefs.h"
+#include "sdcard.h"
+#include "../src/sd_disc.c"
+
+#define MHZ(n)          ((n) * 1000 * 1000)
+#define SCRATCH_BYTES   (2 * SD_TUNE_SECTORS * SD_DISC_SECTOR_SIZE)
+
+static uint8_t ram[SCRATCH_BYTES + 1024];
+static const pico_fatfs_spi_config_t spi = { .spi_inst = spi0, .pin_cs = 21, .clk_fast = MHZ(25) };
+static uint32_t blocks_written;
+
+static void     block_written(uint32_t lba)
+{
+        blocks_written++;
+}
+
+/* Tune, checking the RAM either side of the scratch is left alone */
+static uint32_t tune(void)
+{
+        memset(ram, 0xa5, sizeof(ram));
+        sd_disc_tune_clock(&spi, ram + 512, SCRATCH_BYTES);
+        for (int i = 0; i < 512; i++)
+                CHECK(ram[i] == 0xa5 && ram[sizeof(ram) - 1 - i] == 0xa5, "RAM outside scratch changed");
+        return spi_get_baudrate(spi0);
+}
+
+int main(void)
+{
+        static FATFS fs;
+        FILINFO info;
+        uint32_t hz, commands;
+
+        fakefs_format(16384);
+        sdcard_attach(spi.pin_cs);
+        spi_set_baudrate(spi0, MHZ(25));
+        CHECK(f_mount(&fs, "", 1) == FR_OK, "mount");
+        f_mkdir(SD_STATE_DIR);
+
+        /* Reads hold up at 42MHz, writes only at 32 */
+        sdcard_read_max_hz = MHZ(42);
+        sdcard_write_max_hz = MHZ(32);
+        hz = tune();
+        CHECK(hz <= sdcard_write_max_hz && hz >= MHZ(25), "tuned to %u Hz", hz);
+        CHECK(f_stat(SD_TUNE_FILE, &info) == FR_OK, "rate not cached");
+        CHECK(f_stat(SD_TUNE_WRITE_FILE, &info) != FR_OK, "write test file left behind");
+        printf("reads to 42MHz, writes to 32MHz: tuned to %u Hz\n", hz);
+
+        /* Next boot, the cached rate is checked by reads, writing nothing:
+         * the card model counts blocks written, and FatFs refuses writes
+         * (so no scratch file could be made)
+         */
+        sdcard_written = block_written;
+        fakefs_fail_writes = true;
+        commands = sdcard_stats.commands;
+        CHECK(tune() == hz, "cached rate not used");
+        uint32_t cached_commands = sdcard_stats.commands - commands;
+        CHECK(blocks_written == 0 && fakefs_stats.failed_writes == 0,
+              "cached rate wrote %u blocks, tried %u FatFs writes", blocks_written,
+              fakefs_stats.failed_writes);
+        fakefs_fail_writes = false;
+
+        /* The card got worse at reading: the cached rate fails, tune again */
+        sdcard_read_max_hz = MHZ(22);
+        commands = sdcard_stats.commands;
+        hz = tune();
+        CHECK(hz <= sdcard_read_max_hz && hz >= SD_TUNE_MIN_HZ, "retuned to %u Hz", hz);
+        CHECK(sdcard_stats.commands - commands > cached_commands && blocks_written > 0, "didn't retune");
+        printf("reads to 22MHz: retuned to %u Hz, %u card commands (%u with a cached rate)\n",
+               hz, sdcard_stats.commands - commands, cached_commands);
+
+        /* Nothing works: FatFs's own rate */
+        sdcard_read_max_hz = sdcard_write_max_hz = 1;
+        hz = tune();
+        CHECK(hz == spi_set_baudrate(spi0, spi.clk_fast), "fell back to %u Hz", hz);
+        CHECK(f_stat(SD_TUNE_WRITE_FILE, &info) != FR_OK, "write test file left behind");
+
+        return test_exit();
+}
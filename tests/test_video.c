@@ -0,0 +1,205 @@
+/*
+ * DVI scanline path (src/video.c) on the host.
+ *
+ * Every line queued for scan-out is checked against an encode of the
+ * framebuffer made here, independently of table[] and the fused lookup, over
+ * a sequence of frames: a static desktop, a moving cursor, noise, and lines
+ * rewritten while the frame is being scanned.  With the line cache, every
+ * valid slot must hold the symbols for the bytes it is keyed by, and the hit
+ * rate on the static desktop and moving cursor is reported.
+ */
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "../src/video.c"
+
+/* Scan-out reads lines 1 to VIDEO_FB_VRES, as set_framebuffer() is given
+ * the Mac's framebuffer address minus one line.
+ */
+static uint8_t __attribute__((aligned(4))) framebuffer[(VIDEO_FB_VRES + 1) * STRIDE];
+
+static uint32_t rng = 1;
+
+static uint32_t next_random(void)
+{
+        rng = rng * 1664525 + 1013904223;
+        return rng;
+}
+
+/* Mac pixels are MSB first and 1 is black; DVI wants 1 for white */
+static void reference_line(uint y, uint32_t *out)
+{
+        const uint8_t *line = NULL;
+
+        if (y > FIRST_LINE && y < LAST_LINE)
+                line = framebuffer + (y - FIRST_LINE) * STRIDE;
+
+        for (int x = 0; x < FRAME_WIDTH; x += 2) {
+                uint32_t word = 0;
+
+                for (int p = 0; p < 2; p++) {
+                        int mx = x + p - HORIZONTAL_OFFSET * 8;
+                        bool white = false;
+
+                        if (line != NULL && mx >= 0 && mx < VIDEO_FB_HRES)
+                                white = !((line[mx / 8] >> (7 - mx % 8)) & 1);
+                        word |= (white ? TMDS_SYMBOL_1 : TMDS_SYMBOL_0) << (10 * p);
+                }
+                out[x / 2] = word;
+        }
+}
+
+typedef void (*scan_hook)(uint y);
+
+/* Scan one frame, checking each line.  The hook runs before each line is
+ * prepared, standing in for the emulator drawing while scan-out is busy.
+ */
+static int scan_frame(scan_hook hook)
+{
+        static uint32_t expected[LINE_WORDS];
+        int bad = 0;
+
+        for (uint y = 0; y < FRAME_HEIGHT; y++) {
+                uint32_t *tmdsbuf;
+
+                if (hook != NULL)
+                        hook(y);
+                reference_line(y, expected);
+                scanline_callback();
+
+                queue_remove_blocking(&dvi0.q_tmds_valid, &tmdsbuf);
+                if (memcmp(tmdsbuf, expected, sizeof(expected)) != 0)
+                        bad++;
+                queue_add_blocking(&dvi0.q_tmds_free, &tmdsbuf);
+        }
+
+        return bad;
+}
+
+#if VIDEO_LINE_CACHE
+static int check_slots(void)
+{
+        static uint32_t expected[ACTIVE_WORDS];
+        uint32_t snap[STRIDE / 4];
+        int bad = 0;
+
+        for (int i = 0; i < VIDEO_LINE_CACHE; i++) {
+                struct line_cache_slot *slot = &line_cache[i];
+
+                if (!slot->valid)
+                        continue;
+
+                encode_line_table((const uint8_t *)slot->src, expected);
+                if (line_cache_slot((const uint8_t *)slot->src, snap) != slot ||
+                    memcmp(slot->tmds, expected, sizeof(expected)) != 0)
+                        bad++;
+        }
+
+        return bad;
+}
+#endif
+
+/* 50% grey desktop, white menu bar, and a white window with a black frame */
+static void draw_desktop(void)
+{
+        for (int y = 1; y <= VIDEO_FB_VRES; y++) {
+                uint8_t *line = framebuffer + y * STRIDE;
+                int my = y - 1;
+
+                if (my < 19)
+                        memset(line, 0x00, STRIDE);
+                else if (my == 19)
+                        memset(line, 0xff, STRIDE);
+                else
+                        memset(line, (my & 1) ? 0xaa : 0x55, STRIDE);
+
+                if (my >= 60 && my < 250) {
+                        bool edge = my == 60 || my == 249;
+
+                        memset(line + 8, edge ? 0xff : 0x00, 40);
+                        line[8] |= 0x80;
+                        line[47] |= 0x01;
+                }
+        }
+}
+
+static uint8_t cursor_save[16][3];
+
+static void draw_cursor(int x, int y, bool draw)
+{
+        for (int r = 0; r < 16; r++) {
+                uint8_t *p = framebuffer + (y + r + 1) * STRIDE + x / 8;
+
+                if (draw) {
+                        memcpy(cursor_save[r], p, 3);
+                        p[0] |= 0xff >> (x % 8);
+                        p[1] |= 0xff;
+                } else {
+                        memcpy(p, cursor_save[r], 3);
+                }
+        }
+}
+
+static void scribble(uint y)
+{
+        //Rewrite the line being scanned, and one already scanned
+        if (y > FIRST_LINE && y < LAST_LINE) {
+                framebuffer[(y - FIRST_LINE) * STRIDE + next_random() % STRIDE] ^= 1u << (next_random() % 8);
+                framebuffer[(next_random() % VIDEO_FB_VRES + 1) * STRIDE] = next_random();
+        }
+}
+
+int main(void)
+{
+        uint32_t *tmdsbuf;
+
+        video_init();
+        //video_init() primes the first line; hand it back to the serialiser
+        queue_remove_blocking(&dvi0.q_tmds_valid, &tmdsbuf);
+        queue_add_blocking(&dvi0.q_tmds_free, &tmdsbuf);
+
+        set_framebuffer(framebuffer);
+
+        draw_desktop();
+        for (int f = 0; f < 10; f++)
+                CHECK(scan_frame(NULL) == 0, "static desktop frame %d", f);
+
+#if VIDEO_LINE_CACHE
+        CHECK(check_slots() == 0, "static desktop");
+        line_cache_hits = 0;
+        line_cache_misses = 0;
+#endif
+
+        for (int f = 0; f < 60; f++) {
+                draw_cursor(100 + f * 5, 40 + f * 3, true);
+                CHECK(scan_frame(NULL) == 0, "cursor frame %d", f);
+                draw_cursor(100 + f * 5, 40 + f * 3, false);
+        }
+
+#if VIDEO_LINE_CACHE
+        uint32_t lines = line_cache_hits + line_cache_misses;
+
+        printf("line cache: %u slots, %u hits of %u lines (%u%%) with a moving cursor\n",
+               VIDEO_LINE_CACHE, line_cache_hits, lines, line_cache_hits * 100 / lines);
+        //The desktop is a handful of distinct lines, most frames are replays
+        CHECK(line_cache_hits * 2 > lines, "hit rate");
+        CHECK(check_slots() == 0, "moving cursor");
+#endif
+
+        for (int f = 0; f < 5; f++) {
+                for (size_t i = 0; i < sizeof(framebuffer); i++)
+                        framebuffer[i] = next_random() >> 24;
+                CHECK(scan_frame(NULL) == 0, "noise frame %d", f);
+        }
+
+        draw_desktop();
+        for (int f = 0; f < 20; f++)
+                CHECK(scan_frame(scribble) == 0, "scribbled frame %d", f);
+
+#if VIDEO_LINE_CACHE
+        CHECK(check_slots() == 0, "after scribbling");
+#endif
+
+        return test_exit();
+}
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+#
+# Pack a raw disc image for pico-umac's flash as independently decodable
+# LZ4 chunks, and write it out as a C initialiser like `xxd -i` does:
+#
+#   tools/pack_disc.py disc.bin > incbin/umac-disc.h
+#
+# then build with -DDISC_PACKED=1.  All-zero chunks take no space.
+#
+# Format (little-endian):
+#   u8[4]  magic "UMPK"
+#   u8     version (1)
+#   u8     log2(chunk size)
+#   u16    reserved
+#   u32    unpacked image size
+#   u32    number of chunks, n
+#   u32    offset[n + 1], chunk i's data is [offset[i], offset[i+1]) after
+#          the table.  An empty chunk is all zeroes, one as long as its
+#          unpacked size is stored raw, anything else is an LZ4 block.
+
+import argparse
+import struct
+import sys
+
+MAGIC = b'UMPK'
+VERSION = 1
+
+MIN_MATCH = 4
+LAST_LITERALS = 5       # LZ4 block rules, so standard decoders agree
+MF_LIMIT = 12
+
+
+def write_length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def emit_sequence(out, literals, offset=None, match_len=0):
+    lit_len = len(literals)
+    ml = match_len - MIN_MATCH if offset is not None else 0
+    out.append((min(lit_len, 15) << 4) | min(ml, 15))
+    if lit_len >= 15:
+        write_length(out, lit_len - 15)
+    out += literals
+    if offset is None:
+        return
+    out += struct.pack('<H', offset)
+    if ml >= 15:
+        write_length(out, ml - 15)
+
+
+def lz4_compress(src):
+    """Greedy LZ4 block compressor, one candidate per 4-byte prefix."""
+    n = len(src)
+    out = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+
+    while i < n - MF_LIMIT:
+        key = src[i:i + 4]
+        cand = table.get(key)
+        table[key] = i
+        if cand is None or i - cand > 0xffff:
+            i += 1
+            continue
+
+        m = MIN_MATCH
+        max_m = n - LAST_LITERALS - i
+        while m < max_m and src[cand + m] == src[i + m]:
+            m += 1
+
+        emit_sequence(out, src[anchor:i], i - cand, m)
+        i += m
+        anchor = i
+
+    emit_sequence(out, src[anchor:])
+    return bytes(out)
+
+
+def lz4_decompress(src, size):
+    out = bytearray()
+    i = 0
+    while i < len(src):
+        token = src[i]
+        i += 1
+        lit_len = token >> 4
+        if lit_len == 15:
+            while True:
+                b = src[i]
+                i += 1
+                lit_len += b
+                if b != 255:
+                    break
+        out += src[i:i + lit_len]
+        i += lit_len
+        if i >= len(src):
+            break
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        match_len = token & 15
+        if match_len == 15:
+            while True:
+                b = src[i]
+                i += 1
+                match_len += b
+                if b != 255:
+                    break
+        match_len += MIN_MATCH
+        for _ in range(match_len):
+            out.append(out[-offset])
+    if len(out) != size:
+        raise ValueError('decoded %d bytes, expected %d' % (len(out), size))
+    return bytes(out)
+
+
+def pack(image, chunk_size):
+    chunks = []
+    for pos in range(0, len(image), chunk_size):
+        raw = image[pos:pos + chunk_size]
+        if raw.count(0) == len(raw):
+            data = b''
+        else:
+            data = lz4_compress(raw)
+            if len(data) >= len(raw):
+                data = raw
+            elif lz4_decompress(data, len(raw)) != raw:
+                raise ValueError('chunk at %d does not round-trip' % pos)
+        chunks.append(data)
+
+    offsets = [0]
+    for c in chunks:
+        offsets.append(offsets[-1] + len(c))
+
+    header = MAGIC + struct.pack('<BBHII', VERSION, chunk_size.bit_length() - 1,
+                                 0, len(image), len(chunks))
+    table = struct.pack('<%dI' % len(offsets), *offsets)
+    return header + table + b''.join(chunks), chunks
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Pack a disc image for flash as LZ4 chunks')
+    ap.add_argument('image', help='raw disc image')
+    ap.add_argument('-c', '--chunk', type=int, default=4096,
+                    help='chunk size, a power of two from 512 to 16384 (default 4096); '
+                         'must match DISC_PACKED_CHUNK')
+    ap.add_argument('-o', '--output', help='write the C initialiser here instead of stdout')
+    args = ap.parse_args()
+
+    if args.chunk & (args.chunk - 1) or not 512 <= args.chunk <= 16384:
+        ap.error('chunk size must be a power of two from 512 to 16384')
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+
+    packed, chunks = pack(image, args.chunk)
+
+    lines = []
+    for pos in range(0, len(packed), 12):
+        lines.append('  ' + ', '.join('0x%02x' % b for b in packed[pos:pos + 12]))
+    text = ',\n'.join(lines) + '\n'
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+    zero = sum(1 for c in chunks if not c)
+    raw = sum(1 for c in chunks if len(c) == args.chunk)
+    print('%s: %d -> %d bytes (%d%%), %d chunks: %d zero, %d stored' %
+          (args.image, len(image), len(packed), len(packed) * 100 // max(len(image), 1),
+           len(chunks), zero, raw), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
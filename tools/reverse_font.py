@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+#
+# Turn include/font_8x8.h (one row of every glyph after another, LSB on
+# the left) into the table the menu blits from: each glyph's 8 rows
+# together, bit-reversed for the Mac framebuffer (MSB on the left).  The
+# FONT_* sizes come along, so the menu needs only this header.
+# Run by the build:
+#
+#   tools/reverse_font.py include/font_8x8.h > font_8x8_rev.h
+
+import re
+import sys
+
+def define(src, name):
+    return int(re.search(r'#define\s+%s\s+(\d+)' % name, src).group(1))
+
+
+def main():
+    src = open(sys.argv[1]).read()
+    sizes = ['FONT_CHAR_WIDTH', 'FONT_CHAR_HEIGHT', 'FONT_N_CHARS',
+             'FONT_FIRST_ASCII']
+    n_chars = define(src, 'FONT_N_CHARS')
+    height = define(src, 'FONT_CHAR_HEIGHT')
+    first = define(src, 'FONT_FIRST_ASCII')
+    table = src[src.index('{'):src.index('}')]
+    data = [int(x, 16) for x in re.findall(r'0x[0-9a-fA-F]{2}', table)]
+
+    out = sys.stdout
+    out.write('// Generated from %s by tools/reverse_font.py, do not edit\n\n'
+              % sys.argv[1].split('/')[-1])
+    for name in sizes:
+        out.write('#define %s %d\n' % (name, define(src, name)))
+    out.write('\n')
+    out.write('static const uint8_t __attribute__((aligned(4))) '
+              'font_8x8_rev[%d][%d] = {\n' % (n_chars, height))
+    for c in range(n_chars):
+        rows = [int('{:08b}'.format(data[row * n_chars + c])[::-1], 2)
+                for row in range(height)]
+        out.write('\t{ %s }, // %r\n' % (', '.join('0x%02x' % b for b in rows),
+                                        chr(c + first)))
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()